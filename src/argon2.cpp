@@ -1,6 +1,21 @@
+#if !defined(__wasm__)
+#   define ARGON2_THREADS 1
+#   include <new>
+#   include <pthread.h>
+#   include <stdlib.h>
+#   include <sys/mman.h>
+#   include <time.h>
+#   include <unistd.h>
+#   include "passwordhash.h"
+#elif defined(__wasm_atomics__)
+#   define ARGON2_THREADS 1
+#endif
+
+
 inline namespace {
 
     using uint8_t = __UINT8_TYPE__;
+    using int32_t = __INT32_TYPE__;
     using uint32_t = __UINT32_TYPE__;
     using uint64_t = __UINT64_TYPE__;
     using uintptr_t = __UINTPTR_TYPE__;
@@ -58,9 +73,20 @@ namespace std {
 
 inline namespace {
 
-#ifdef GENKAT
+#if defined(GENKAT) || defined(BENCHMARK) || defined(CHECK)
     extern "C" int printf(const char *format, ...);
+#endif
+
+#if !defined(__wasm__)
+    // Monotonic clock in seconds.
+    double now() {
+        timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+#endif
 
+#ifdef GENKAT
     void print_hex(const char *what, const void *out, uint32_t outlen) {
         if (!out) {
             return;
@@ -83,22 +109,25 @@ inline namespace {
     };
 
 
-    // values can be tweaked:
+    // values can be tweaked, the hashing loop is specialized for the default values:
 
-    static inline constexpr uint32_t memory_size_kb = 64 * 1024;
-    static inline constexpr uint32_t iterations = 4;
-    static inline constexpr uint32_t tag_length = 32;
+    static inline constexpr uint32_t default_parallelism = 1;
+    static inline constexpr uint32_t default_memory_size_kb = 64 * 1024;
+    static inline constexpr uint32_t default_iterations = 4;
+    static inline constexpr uint32_t default_tag_length = 32;
+    static inline constexpr uint32_t default_hash_type = static_cast<uint32_t>(Argon2_type::d);
 
     // other values aren't implemented:
 
-    static inline constexpr uint32_t parallelism = 1;
     static inline constexpr uint32_t version = 0x13;
-    static inline constexpr uint32_t hash_type = static_cast<uint32_t>(Argon2_type::d);
     static inline constexpr uint32_t sync_points = 4;
-    static inline constexpr uint32_t lanes = 1;
-    static inline constexpr uint32_t memory_blocks = memory_size_kb;
-    static inline constexpr uint32_t segment_length = memory_blocks / (lanes * sync_points);
-    static inline constexpr uint32_t lane_length = segment_length * lanes * sync_points;
+
+    // limits of the parameters that are read from the request:
+
+    static inline constexpr uint32_t max_memory_size_kb = 1024 * 1024;
+    static inline constexpr uint32_t max_parallelism = (1u << 24) - 1;
+    static inline constexpr uint32_t min_tag_length = 4;
+    static inline constexpr uint32_t max_tag_length = 1024;
 
 
     class Endian {
@@ -122,13 +151,110 @@ inline namespace {
         uint64_t u128[64][2];
     };
 
-    using Blocks = Block[memory_blocks];
 
+    // Parameters of a single hash.
+    struct Params {
+        uint32_t lanes;
+        uint32_t tag_length;
+        uint32_t memory_size_kb;
+        uint32_t iterations;
+        Argon2_type type;
 
-    size_t minZ(size_t a, size_t b) {
-        return a <= b ? a : b;
+        // Derived from the values above.
+        uint32_t segment_length;
+        uint32_t lane_length;
+
+        bool set(
+            uint32_t parallelism, uint32_t tag_length_, uint32_t memory_size_kb_, uint32_t iterations_,
+            uint32_t hash_type
+        ) {
+            if (
+                (parallelism < 1 || parallelism > max_parallelism) ||
+                (tag_length_ < min_tag_length || tag_length_ > max_tag_length) ||
+                (memory_size_kb_ < 2 * sync_points * parallelism || memory_size_kb_ > max_memory_size_kb) ||
+                (iterations_ < 1) ||
+                (hash_type > static_cast<uint32_t>(Argon2_type::id))
+            ) {
+                return false;
+            }
+
+            lanes = parallelism;
+            tag_length = tag_length_;
+            memory_size_kb = memory_size_kb_;
+            iterations = iterations_;
+            type = static_cast<Argon2_type>(hash_type);
+
+            // RFC 9106: m' = 4 * p * floor(m / (4 * p))
+            segment_length = memory_size_kb / (lanes * sync_points);
+            lane_length = segment_length * sync_points;
+            return true;
+        }
+    };
+
+
+    // The dimensions of the memory as compile time constants, so that the compiler can fold them into
+    // the hashing loop.
+    template <uint32_t lanes_, uint32_t memory_size_kb_, uint32_t iterations_>
+    struct Fixed_shape {
+        static constexpr uint32_t lanes = lanes_;
+        static constexpr uint32_t iterations = iterations_;
+        static constexpr uint32_t segment_length = memory_size_kb_ / (lanes_ * sync_points);
+        static constexpr uint32_t lane_length = segment_length * sync_points;
+
+        static bool matches(const Params &params) {
+            return (
+                params.lanes == lanes &&
+                params.segment_length == segment_length &&
+                params.iterations == iterations
+            );
+        }
+    };
+
+    // The dimensions of the memory as read from the request.
+    struct Dynamic_shape {
+        uint32_t lanes;
+        uint32_t iterations;
+        uint32_t segment_length;
+        uint32_t lane_length;
+
+
+        explicit Dynamic_shape(const Params &params) :
+            lanes(params.lanes),
+            iterations(params.iterations),
+            segment_length(params.segment_length),
+            lane_length(params.lane_length) {
+        }
+    };
+
+    using Default_shape = Fixed_shape<default_parallelism, default_memory_size_kb, default_iterations>;
+
+    template <class... Shapes>
+    struct Shape_list {};
+
+    // Every shape gets its own hashing loop, all other parameters use the generic one.
+    // Each adds the size of a hashing loop to the module.
+    using Fixed_shapes = Shape_list<
+        // 64 MiB, four passes
+        Default_shape,
+        // 19 MiB, two passes, as recommended by OWASP for Argon2id
+        Fixed_shape<1, 19 * 1024, 2>,
+        // 256 MiB, three passes
+        Fixed_shape<1, 256 * 1024, 3>
+    >;
+
+
+#if defined(__wasm__) && defined(__wasm_bulk_memory__)
+    // There is no libc in WebAssembly, but the builtins are lowered to memory.copy and memory.fill.
+
+    extern "C" void *memcpy(void *dst, const void* src, size_t cnt) {
+        return __builtin_memcpy(dst, src, cnt);
     }
 
+    extern "C" void *memset(void *d, int c, size_t cnt) {
+        return __builtin_memset(d, c, cnt);
+    }
+#elif defined(__wasm__)
+    // There is no libc in WebAssembly.
 
     template <class I>
     void memcpy_round(void *&dst, const void *&src, size_t &cnt, size_t n) {
@@ -183,42 +309,47 @@ inline namespace {
     extern "C" void *memcpy(void *dst, const void* src, size_t cnt) {
         using I = uint64_t;
 
+        void *const result = dst;
         if (cnt == 0 || dst == src) {
-            return reinterpret_cast<uintptr_t*>(dst) + cnt;
+            return result;
         }
 
-        if (auto missalign = reinterpret_cast<uintptr_t>(dst) % sizeof(I)) {
-            memcpy_round<uint8_t>(dst, src, cnt, minZ(cnt, sizeof(I) - missalign));
+        while (cnt && reinterpret_cast<uintptr_t>(dst) % sizeof(I)) {
+            memcpy_round<uint8_t>(dst, src, cnt, 1);
         }
-        while (auto r = cnt / sizeof(uint64_t)) {
-            memcpy_round<uint64_t>(dst, src, cnt, r);
+        while (auto r = cnt / sizeof(I)) {
+            memcpy_round<I>(dst, src, cnt, r);
+        }
+        while (cnt) {
+            memcpy_round<uint8_t>(dst, src, cnt, cnt);
         }
-        memcpy_round<uint8_t>(dst, src, cnt, cnt);
 
-        return dst;
+        return result;
     }
 
     extern "C" void *memset(void *d, int c, size_t cnt) {
+        void *const result = d;
         if (!c) {
             using I = uint64_t;
 
-            if (auto missalign = reinterpret_cast<uintptr_t>(d) % sizeof(I)) {
-                memset0_round<uint8_t>(d, cnt, minZ(cnt, sizeof(I) - missalign));
+            while (cnt && reinterpret_cast<uintptr_t>(d) % sizeof(I)) {
+                memset0_round<uint8_t>(d, cnt, 1);
             }
             while (auto r = cnt / sizeof(I)) {
                 memset0_round<I>(d, cnt, r);
             }
-            memset0_round<uint8_t>(d, cnt, cnt);
-
-            return d;
+            while (cnt) {
+                memset0_round<uint8_t>(d, cnt, cnt);
+            }
         } else {
             uint8_t *d1 = reinterpret_cast<uint8_t*>(d);
             while (cnt--) {
-                *(d1) = static_cast<unsigned>(c) & 0xffu;
+                *(d1++) = static_cast<unsigned>(c) & 0xffu;
             }
-            return d1;
         }
+        return result;
     }
+#endif
 
 #   define memcpy(D, S, N) __builtin_memcpy((D), (S), (N))
 #   define memset(S, C, N) __builtin_memset((S), (C), (N))
@@ -240,179 +371,382 @@ inline namespace {
     };
 
 
-    class Blake2b {
-    private:
-        struct {
-            uint64_t h[8];
-            uint64_t t;  // RFC: uint128_t
-            uint8_t buffer_length; // 0..128
-            union {
-                uint8_t bytes[128];
-                uint64_t words[16];
-            } buffer;
-        } S;
+    // Blake2b, RFC 7693
 
-        static constexpr const uint8_t SIGMA[12][16] = {
-            {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
-            { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
-            { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
-            {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
-            {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
-            {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
-            { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
-            { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
-            {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
-            { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
-
-            {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
-            { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
-        };
+    static inline constexpr uint8_t blake2b_SIGMA[12][16] = {
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+        { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+        { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+        {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+        {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+        {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+        { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+        { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+        {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+        { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
 
-        static constexpr const uint64_t IV[8] = {
-            UINT64_C(0x6a09e667f3bcc908),
-            UINT64_C(0xbb67ae8584caa73b),
-            UINT64_C(0x3c6ef372fe94f82b),
-            UINT64_C(0xa54ff53a5f1d36f1),
-            UINT64_C(0x510e527fade682d1),
-            UINT64_C(0x9b05688c2b3e6c1f),
-            UINT64_C(0x1f83d9abfb41bd6b),
-            UINT64_C(0x5be0cd19137e2179),
-        };
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+        { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    };
+
+    static inline constexpr uint64_t blake2b_IV[8] = {
+        UINT64_C(0x6a09e667f3bcc908),
+        UINT64_C(0xbb67ae8584caa73b),
+        UINT64_C(0x3c6ef372fe94f82b),
+        UINT64_C(0xa54ff53a5f1d36f1),
+        UINT64_C(0x510e527fade682d1),
+        UINT64_C(0x9b05688c2b3e6c1f),
+        UINT64_C(0x1f83d9abfb41bd6b),
+        UINT64_C(0x5be0cd19137e2179),
+    };
+
+
+    using u64x2 = uint64_t __attribute__((vector_size(16)));
+    using u64x4 = uint64_t __attribute__((vector_size(32)));
+    using u64x8 = uint64_t __attribute__((vector_size(64)));
 
-        static void mix(uint64_t &a, uint64_t &b, uint64_t &c, uint64_t &d, uint64_t x, uint64_t y) {
+
+    // The compression function of Blake2b for the word type V: uint64_t for one message, or a vector with one
+    // message per element, so that independent messages of the same length are hashed in lockstep.
+    template <class V>
+    struct Blake2b_words {
+        static constexpr unsigned W = sizeof(V) / sizeof(uint64_t);
+
+        template <unsigned amount>
+        [[gnu::always_inline]]
+        static void xor_ror(V &a, const V &b) {
+            V x = a ^ b;
+            a = (x >> amount) | (x << (64 - amount));
+        }
+
+        [[gnu::always_inline]]
+        static void mix(V &a, V &b, V &c, V &d, const V &x, const V &y) {
             a = a + b + x;
-            d = ror(d ^ a, 32);
+            xor_ror<32>(d, a);
             c = c + d;
-            b = ror(b ^ c, 24);
+            xor_ror<24>(b, c);
             a = a + b + y;
-            d = ror(d ^ a, 16);
+            xor_ror<16>(d, a);
             c = c + d;
-            b = ror(b ^ c, 63);
+            xor_ror<63>(b, c);
         }
 
-        void compress(bool is_last_block) {
-            alignas(512 / 8) uint64_t V[16];
+        // The permutation of the message words is known at compile time.
+        template <unsigned r>
+        [[gnu::always_inline]]
+        static void round(V (&v)[16], const V (&m)[16]) {
+            constexpr auto &sigma = blake2b_SIGMA[r];
+
+            mix(v[0], v[4], v[ 8], v[12], m[sigma[ 0]], m[sigma[ 1]]);
+            mix(v[1], v[5], v[ 9], v[13], m[sigma[ 2]], m[sigma[ 3]]);
+            mix(v[2], v[6], v[10], v[14], m[sigma[ 4]], m[sigma[ 5]]);
+            mix(v[3], v[7], v[11], v[15], m[sigma[ 6]], m[sigma[ 7]]);
+
+            mix(v[0], v[5], v[10], v[15], m[sigma[ 8]], m[sigma[ 9]]);
+            mix(v[1], v[6], v[11], v[12], m[sigma[10]], m[sigma[11]]);
+            mix(v[2], v[7], v[ 8], v[13], m[sigma[12]], m[sigma[13]]);
+            mix(v[3], v[4], v[ 9], v[14], m[sigma[14]], m[sigma[15]]);
+        }
+
+        template <unsigned... r>
+        [[gnu::always_inline]]
+        static void rounds(V (&v)[16], const V (&m)[16]) {
+            (round<r>(v, m), ...);
+        }
+
+        [[gnu::always_inline]]
+        static void compress(V (&h)[8], const V (&m)[16], uint64_t t, bool is_last_block) {
+            V v[16];
             for (unsigned i = 0; i < 8; ++i) {
-                V[i] = S.h[i];
+                v[i] = h[i];
+                v[8 + i] = V{} + blake2b_IV[i];
+            }
+
+            v[12] ^= t;
+            if (is_last_block) {
+                v[14] = ~v[14];
             }
+
+            rounds<0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11>(v, m);
+
             for (unsigned i = 0; i < 8; ++i) {
-                V[8 + i] = IV[i];
+                h[i] ^= v[i] ^ v[i + 8];
             }
+        }
 
-            V[12] ^= S.t;
-            if (is_last_block) {
-                V[14] = ~V[14];
+        // Hashes W messages of the same length.
+        class Multi {
+        private:
+            V h[8];
+            uint64_t t;
+            uint32_t buffer_length;  // 0..128, the same for all messages
+            alignas(512 / 8) uint8_t buffer[W][128];
+
+            [[gnu::always_inline]]
+            void compress(bool is_last_block) {
+                V m[16];
+                for (unsigned i = 0; i < 16; ++i) {
+                    alignas(sizeof(V)) uint64_t words[W];
+                    for (unsigned n = 0; n < W; ++n) {
+                        memcpy(&words[n], &buffer[n][8 * i], sizeof(uint64_t));
+                    }
+                    memcpy(&m[i], words, sizeof(V));
+                }
+                Blake2b_words::compress(h, m, t, is_last_block);
             }
 
-            const auto &m = S.buffer.words;
+            // Only compresses a full buffer if more data follows, the last block is compressed in finalize().
+            template <class Source>
+            [[gnu::always_inline]]
+            void update(uint32_t inlen, Source source) {
+                uint32_t pos = 0;
+                while (pos < inlen) {
+                    if (buffer_length == sizeof(buffer[0])) {
+                        compress(false);
+                        buffer_length = 0;
+                    }
 
-            // Twelve rounds of cryptographic message mixing
-            for (unsigned i = 0; i < 12; ++i) {
-                auto &sigma = SIGMA[i];
+                    uint32_t cnt = min32(sizeof(buffer[0]) - buffer_length, inlen - pos);
+                    for (unsigned n = 0; n < W; ++n) {
+                        memcpy(&buffer[n][buffer_length], source(n) + pos, cnt);
+                    }
 
-                mix(V[0], V[4], V[ 8], V[12], m[sigma[ 0]], m[sigma[ 1]]);
-                mix(V[1], V[5], V[ 9], V[13], m[sigma[ 2]], m[sigma[ 3]]);
-                mix(V[2], V[6], V[10], V[14], m[sigma[ 4]], m[sigma[ 5]]);
-                mix(V[3], V[7], V[11], V[15], m[sigma[ 6]], m[sigma[ 7]]);
+                    buffer_length += cnt;
+                    t += cnt;
+                    pos += cnt;
+                }
+            }
 
-                mix(V[0], V[5], V[10], V[15], m[sigma[ 8]], m[sigma[ 9]]);
-                mix(V[1], V[6], V[11], V[12], m[sigma[10]], m[sigma[11]]);
-                mix(V[2], V[7], V[ 8], V[13], m[sigma[12]], m[sigma[13]]);
-                mix(V[3], V[4], V[ 9], V[14], m[sigma[14]], m[sigma[15]]);
+        public:
+            [[gnu::always_inline]]
+            explicit Multi(uint32_t outlen) {
+                for (unsigned i = 0; i < 8; ++i) {
+                    h[i] = V{} + blake2b_IV[i];
+                }
+                h[0] ^= UINT64_C(0x01010000) | outlen;
+                t = 0;
+                buffer_length = 0;
             }
 
-            // Mix the upper and lower halves of V into ongoing state vector h
-            for (unsigned i = 0; i < 8; ++i) {
-                S.h[i] ^= V[i];
+            // Appends inlen bytes of each message.
+            [[gnu::always_inline]]
+            void update(const uint8_t *const (&in)[W], uint32_t inlen) {
+                update(inlen, [&](unsigned n) { return in[n]; });
             }
-            for (unsigned i = 0; i < 8; ++i) {
-                S.h[i] ^= V[i + 8];
+
+            // Appends the same bytes to every message.
+            [[gnu::always_inline]]
+            void update_all(const void *in, uint32_t inlen) {
+                const uint8_t *c = reinterpret_cast<const uint8_t*>(in);
+                update(inlen, [&](unsigned) { return c; });
             }
-        }
 
-    public:
-        explicit Blake2b(uint32_t outlen) {
-            memcpy(S.h, IV, sizeof(S.h));
-            S.h[0] ^= UINT64_C(0x01010000) | outlen;
-            S.t = 0;
-            S.buffer_length = 0;
-        }
+            [[gnu::always_inline]]
+            void finalize(uint8_t *const (&out)[W], uint32_t outlen) {
+                for (unsigned n = 0; n < W; ++n) {
+                    memset(&buffer[n][buffer_length], 0, sizeof(buffer[n]) - buffer_length);
+                }
+                compress(true);
 
-        void update(const void *in, uint32_t inlen) {
-            const uint8_t *c = reinterpret_cast<const uint8_t*>(in);
-            while (inlen) {
-                uint32_t cnt = min32(sizeof(S.buffer) - S.buffer_length, inlen);
-                memcpy(S.buffer.bytes + S.buffer_length, c, cnt);
+                alignas(sizeof(V)) uint64_t words[8][W];
+                memcpy(words, h, sizeof(h));
+                for (unsigned n = 0; n < W; ++n) {
+                    for (unsigned i = 0; i < 8 && 8 * i < outlen; ++i) {
+                        memcpy(out[n] + 8 * i, &words[i][n], min32(8, outlen - 8 * i));
+                    }
+                }
+            }
+        };
 
-                S.buffer_length += cnt;
-                S.t += cnt;
-                inlen -= cnt;
-                c += cnt;
+        // H'(1024) of count messages of in_length bytes, W of them at a time.
+        [[gnu::always_inline]]
+        static void hash_blocks(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length) {
+            constexpr uint32_t digest_length = sizeof(Block);
+
+            for (uint32_t first = 0; first < count; first += W) {
+                // The last group is filled up with copies of the first message, their results are discarded.
+                Block spare[W];
+                const uint8_t *src[W];
+                uint8_t *dst[W];
+                for (unsigned n = 0; n < W; ++n) {
+                    bool used = first + n < count;
+                    src[n] = in[used ? first + n : first];
+                    dst[n] = (used ? out[first + n] : &spare[n])->bytes;
+                }
 
-                if (S.buffer_length == sizeof(S.buffer)) {
-                    S.buffer_length = 0;
-                    compress(false);
+                alignas(512 / 8) uint8_t V1[W][64];
+                uint8_t *v1_out[W];
+                const uint8_t *v1_in[W];
+                for (unsigned n = 0; n < W; ++n) {
+                    v1_out[n] = V1[n];
+                    v1_in[n] = V1[n];
+                }
+
+                Multi first_hash(64);
+                first_hash.update_all(&digest_length, sizeof(digest_length));
+                first_hash.update(src, in_length);
+                first_hash.finalize(v1_out, 64);
+
+                uint32_t remaining = digest_length;
+                while (true) {
+                    for (unsigned n = 0; n < W; ++n) {
+                        memcpy(dst[n], V1[n], 32);
+                        dst[n] += 32;
+                    }
+                    remaining -= 32;
+                    if (remaining <= 64) {
+                        break;
+                    }
+
+                    Multi next_hash(64);
+                    next_hash.update(v1_in, 64);
+                    next_hash.finalize(v1_out, 64);
                 }
+
+                Multi last_hash(remaining);
+                last_hash.update(v1_in, 64);
+                last_hash.finalize(dst, remaining);
             }
         }
+    };
 
-        void finalize(void *out, uint32_t outlen) {
-            memset(S.buffer.bytes + S.buffer_length, 0, sizeof(S.buffer) - S.buffer_length);
-            compress(true);
-            memcpy(out, S.h, outlen);
+
+    // The compression function of Blake2b for one message, with one row of the state per vector.
+    // V holds four words; without 256 bit registers the compiler splits it into two halves.
+    template <class V>
+    struct Blake2b_rows {
+        using Words = Blake2b_words<V>;
+
+        template <unsigned amount>
+        [[gnu::always_inline]]
+        static void rotate_words(V &v) {
+            constexpr unsigned a = amount;
+            v = __builtin_shufflevector(v, v, (0 + a) % 4, (1 + a) % 4, (2 + a) % 4, (3 + a) % 4);
         }
 
-        static void hash(void *dest, uint32_t dest_len, std::initializer_list<SrcLen> src_lens) {
-            auto S = Blake2b{dest_len};
-            for (auto [src, src_len] : src_lens) {
-                S.update(src, src_len);
-            }
-            S.finalize(dest, dest_len);
+        [[gnu::always_inline]]
+        static void G(V &a, V &b, V &c, V &d, const V &x, const V &y) {
+            Words::mix(a, b, c, d, x, y);
+        }
+
+        template <unsigned r>
+        [[gnu::always_inline]]
+        static void round(V &a, V &b, V &c, V &d, const uint64_t (&m)[16]) {
+            constexpr auto &sigma = blake2b_SIGMA[r];
+
+            G(
+                a, b, c, d,
+                V{ m[sigma[0]], m[sigma[2]], m[sigma[4]], m[sigma[6]] },
+                V{ m[sigma[1]], m[sigma[3]], m[sigma[5]], m[sigma[7]] }
+            );
+
+            // Rotate the rows, so that the diagonals become columns.
+            rotate_words<1>(b);
+            rotate_words<2>(c);
+            rotate_words<3>(d);
+
+            G(
+                a, b, c, d,
+                V{ m[sigma[ 8]], m[sigma[10]], m[sigma[12]], m[sigma[14]] },
+                V{ m[sigma[ 9]], m[sigma[11]], m[sigma[13]], m[sigma[15]] }
+            );
+
+            rotate_words<3>(b);
+            rotate_words<2>(c);
+            rotate_words<1>(d);
+        }
+
+        template <unsigned... r>
+        [[gnu::always_inline]]
+        static void rounds(V &a, V &b, V &c, V &d, const uint64_t (&m)[16]) {
+            (round<r>(a, b, c, d, m), ...);
+        }
+
+        [[gnu::always_inline]]
+        static void compress(uint64_t (&h)[8], const uint64_t (&m)[16], uint64_t t, bool is_last_block) {
+            V a, b, c, d;
+            memcpy(&a, &h[0], sizeof(V));
+            memcpy(&b, &h[4], sizeof(V));
+            memcpy(&c, &blake2b_IV[0], sizeof(V));
+            memcpy(&d, &blake2b_IV[4], sizeof(V));
+
+            d ^= V{ t, 0, is_last_block ? ~UINT64_C(0) : 0, 0 };
+
+            rounds<0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11>(a, b, c, d, m);
+
+            V h0, h1;
+            memcpy(&h0, &h[0], sizeof(V));
+            memcpy(&h1, &h[4], sizeof(V));
+            h0 ^= a ^ c;
+            h1 ^= b ^ d;
+            memcpy(&h[0], &h0, sizeof(V));
+            memcpy(&h[4], &h1, sizeof(V));
         }
     };
 
 
-    __attribute__((visibility("default")))
-    extern "C" Blocks B = {};
+    // Called by fill_block() as soon as the first word of the new block is known, after the first of the column
+    // permutations. For Argon2d it selects the next reference block, which is then loaded from memory while the
+    // remaining permutations are computed.
+    struct Early_word {
+        void (*callback)(const void *context, uint64_t word);
+        const void *context;
+    };
 
 
-    class Argon2 {
-    private:
-        static void hash(
-            void *digest_, uint32_t digest_length,
-            const void *message_, uint32_t message_length
-        ) {
-            uint8_t *digest = reinterpret_cast<uint8_t*>(digest_);
-            const uint8_t *message = reinterpret_cast<const uint8_t*>(message_);
+#if defined(__x86_64__) || defined(__i386__)
+#   define KERNEL_X86 1
+#   define TARGET_SSSE3 __attribute__((target("ssse3")))
+#   define TARGET_AVX2 __attribute__((target("avx2")))
+#   define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#   define TARGET_SSSE3
+#endif
 
-            if (digest_length <= 64) {
-                Blake2b::hash(digest_, digest_length, {
-                    { &digest_length, sizeof(digest_length) },
-                    { message, message_length },
-                });
-            } else {
-                alignas(512 / 8) uint8_t V1[64];
-                Blake2b::hash(V1, sizeof(V1), {
-                    { &digest_length, sizeof(digest_length) },
-                    { message, message_length },
-                });
+#if defined(__wasm_simd128__) || defined(__ARM_NEON) || defined(KERNEL_X86)
+#   define KERNEL_128 1
+#endif
 
-                while (true) {
-                    memcpy(digest, V1, 32);
-                    digest += 32;
-                    digest_length -= 32;
-                    if (digest_length <= 64) {
-                        break;
-                    }
-                    Blake2b::hash(V1, sizeof(V1), {
-                        { V1, sizeof(V1) },
-                    });
-                }
 
-                Blake2b::hash(digest, digest_length, {
-                    { V1, sizeof(V1) },
-                });
-            }
+    // The products of the low 32 bits of every 64 bit element. Clang finds pmuludq in (x & m) * (y & m) by itself,
+    // GCC multiplies all 64 bits then, which takes three multiplications and four shifts per element.
+    template <class V>
+    [[gnu::always_inline]]
+    inline void mul_lo32(V &xy, const V &x, const V &y) {
+        constexpr uint64_t m = UINT64_C(0xFFFFFFFF);
+        xy = (x & m) * (y & m);
+    }
+
+#if defined(KERNEL_X86) && !defined(__clang__)
+    // The wide builtins would need the target on Kernel_wide itself, the assembly does not.
+    // Both are inlined into the AVX2 and AVX-512 kernels only.
+    [[gnu::always_inline]]
+    inline void mul_lo32(u64x2 &xy, const u64x2 &x, const u64x2 &y) {
+        using i32x4 = int __attribute__((vector_size(16)));
+        xy = (u64x2) __builtin_ia32_pmuludq128((i32x4) x, (i32x4) y);
+    }
+
+    [[gnu::always_inline]]
+    inline void mul_lo32(u64x4 &xy, const u64x4 &x, const u64x4 &y) {
+        asm("vpmuludq %2, %1, %0" : "=x"(xy) : "x"(x), "x"(y));
+    }
+
+    [[gnu::always_inline]]
+    inline void mul_lo32(u64x8 &xy, const u64x8 &x, const u64x8 &y) {
+        asm("vpmuludq %2, %1, %0" : "=v"(xy) : "v"(x), "v"(y));
+    }
+#endif
+
+    // Portable implementation of the compression function, used if no vector unit is available.
+    struct Kernel_ref {
+        static constexpr const char *name = "ref";
+
+        static void blake2b_compress(uint64_t (&h)[8], const uint64_t (&m)[16], uint64_t t, bool is_last_block) {
+            Blake2b_words<uint64_t>::compress(h, m, t, is_last_block);
+        }
+
+        static void hash_blocks(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length) {
+            Blake2b_words<uint64_t>::hash_blocks(out, in, count, in_length);
         }
 
         static uint64_t fBlaMka(uint64_t x, uint64_t y) {
@@ -447,24 +781,13 @@ inline namespace {
             G(v3, v4,  v9, v14);
         }
 
-        static void fill_block(Block &N, const Block &X, const Block &Y, bool with_xor) {
-            Block R;
-            for (unsigned i = 0; i < 128; ++i) {
-                R.u64[i] = X.u64[i] ^ Y.u64[i];
-            }
-
-            Block T;
-            if (with_xor) {
-                for (unsigned i = 0; i < 128; ++i) {
-                    T.u64[i] = R.u64[i] ^ N.u64[i];
-                }
-            } else {
-                T = R;
-            }
-
-            auto &r = R.u64;
+        static void fill_block(Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early) {
+            uint64_t r[128];
 
             for (unsigned i = 0; i < 8; ++i) {
+                for (unsigned k = 0; k < 16; ++k) {
+                    r[16 * i + k] = X.u64[16 * i + k] ^ Y.u64[16 * i + k];
+                }
                 argon2_P(
                     r[(16 * i) +  0], r[(16 * i) +  1], r[(16 * i) +  2], r[(16 * i) +  3],
                     r[(16 * i) +  4], r[(16 * i) +  5], r[(16 * i) +  6], r[(16 * i) +  7],
@@ -480,261 +803,3089 @@ inline namespace {
                     r[(2 * i) + 64], r[(2 * i) + 65], r[(2 * i) +  80], r[(2 * i) +  81],
                     r[(2 * i) + 96], r[(2 * i) + 97], r[(2 * i) + 112], r[(2 * i) + 113]
                 );
+                if (i == 0 && early) {
+                    const uint64_t n = with_xor ? N.u64[0] : 0;
+                    early->callback(early->context, X.u64[0] ^ Y.u64[0] ^ n ^ r[0]);
+                }
             }
 
             for (unsigned i = 0; i < 128; ++i) {
-                N.u64[i] = T.u64[i] ^ R.u64[i];
+                r[i] ^= X.u64[i] ^ Y.u64[i];
+            }
+            if (with_xor) {
+                for (unsigned i = 0; i < 128; ++i) {
+                    r[i] ^= N.u64[i];
+                }
             }
+            memcpy(&N, r, sizeof(r));
         }
+    };
 
-        static uint32_t index_alpha(uint32_t pass_r, uint32_t slice_s, uint32_t index, uint32_t pseudo_rand) {
-            uint32_t reference_area_size;
-            if (pass_r > 0) {
-                reference_area_size = lane_length - segment_length + index - 1;
-            } else if (slice_s == 0) {
-                // First pass, first slice
-                reference_area_size = index - 1;
-            } else {
-                // First pass
-                reference_area_size = slice_s * segment_length + index - 1;
-            }
 
-            uint64_t relative_position = pseudo_rand;
-            relative_position = (relative_position * relative_position) >> 32;
-            relative_position = reference_area_size - 1 - ((reference_area_size * relative_position) >> 32);
+#ifdef KERNEL_128
+    // Two 64 bit lanes per register: WebAssembly SIMD128, SSSE3, NEON.
+    struct Kernel_128 {
+        static constexpr const char *name = "128";
 
-            uint32_t start_position = 0;
-            if (pass_r > 0 && slice_s != sync_points - 1) {
-                start_position = (slice_s + 1) * segment_length;
-            }
+        using u32x4 = uint32_t __attribute__((vector_size(16)));
+        using u8x16 = uint8_t __attribute__((vector_size(16)));
 
-            uint32_t absolute_position = (start_position + relative_position) % lane_length;
-            return absolute_position;
+        TARGET_SSSE3
+        static u64x2 ror32(u64x2 a) {
+            return (u64x2) __builtin_shufflevector((u32x4) a, (u32x4) a, 1, 0, 3, 2);
         }
 
-        static void initialize(std::initializer_list<SrcLen> src_lens) {
-            alignas(512 / 8) struct __attribute__((packed)) {
-                uint8_t H0[64];
-                uint32_t block_no;
-                uint32_t lane_no;
-            } data;
+        TARGET_SSSE3
+        static u64x2 ror24(u64x2 a) {
+            return (u64x2) __builtin_shufflevector(
+                (u8x16) a, (u8x16) a,
+                3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10
+            );
+        }
 
-            // Generate initial 64-byte block H0.
-            Blake2b::hash(data.H0, sizeof(data.H0), src_lens);
+        TARGET_SSSE3
+        static u64x2 ror16(u64x2 a) {
+            return (u64x2) __builtin_shufflevector(
+                (u8x16) a, (u8x16) a,
+                2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9
+            );
+        }
 
-#ifdef GENKAT
-            print_hex("Pre-hashing digest", data.H0, sizeof(data.H0));
-#endif
+        TARGET_SSSE3
+        static u64x2 ror63(u64x2 a) {
+            return (a >> 63) | (a + a);
+        }
 
-            // Compute the first and second block (i.e. column zero and one)
+        TARGET_SSSE3
+        static u64x2 fBlaMka(u64x2 x, u64x2 y) {
+            u64x2 xy;
+            mul_lo32(xy, x, y);
+            return x + y + (xy + xy);
+        }
 
-            data.block_no = 0;
-            data.lane_no = 0;
-            hash(B[0].bytes, sizeof(B[0]), &data, sizeof(data));
+        TARGET_SSSE3
+        static void G(u64x2 &a, u64x2 &b, u64x2 &c, u64x2 &d) {
+            a = fBlaMka(a, b);
+            d = ror32(d ^ a);
+            c = fBlaMka(c, d);
+            b = ror24(b ^ c);
+            a = fBlaMka(a, b);
+            d = ror16(d ^ a);
+            c = fBlaMka(c, d);
+            b = ror63(b ^ c);
+        }
 
-            data.block_no = 1;
-            data.lane_no = 0;
-            hash(B[1].bytes, sizeof(B[1]), &data, sizeof(data));
+        // v[0..1] = v0..v3, v[2..3] = v4..v7, v[4..5] = v8..v11, v[6..7] = v12..v15
+        TARGET_SSSE3
+        static void argon2_P(u64x2 (&v)[8]) {
+            G(v[0], v[2], v[4], v[6]);
+            G(v[1], v[3], v[5], v[7]);
+
+            // Rotate the rows, so that the diagonals become columns.
+            u64x2 b0 = __builtin_shufflevector(v[2], v[3], 1, 2);
+            u64x2 b1 = __builtin_shufflevector(v[3], v[2], 1, 2);
+            u64x2 c0 = v[5];
+            u64x2 c1 = v[4];
+            u64x2 d0 = __builtin_shufflevector(v[7], v[6], 1, 2);
+            u64x2 d1 = __builtin_shufflevector(v[6], v[7], 1, 2);
+
+            G(v[0], b0, c0, d0);
+            G(v[1], b1, c1, d1);
+
+            v[2] = __builtin_shufflevector(b1, b0, 1, 2);
+            v[3] = __builtin_shufflevector(b0, b1, 1, 2);
+            v[4] = c1;
+            v[5] = c0;
+            v[6] = __builtin_shufflevector(d0, d1, 1, 2);
+            v[7] = __builtin_shufflevector(d1, d0, 1, 2);
         }
 
-        static void fill_segment(uint32_t pass_r, uint32_t slice_s) {
-            uint32_t starting_index = 0;
-            if (pass_r == 0 && slice_s == 0) {
-                starting_index = 2;
-            }
+        TARGET_SSSE3
+        static u64x2 load(const Block &B, unsigned i) {
+            u64x2 v;
+            memcpy(&v, B.u128[i], sizeof(v));
+            return v;
+        }
 
-            uint32_t curr_offset = slice_s * segment_length + starting_index;
+        TARGET_SSSE3
+        static void fill_block(Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early) {
+            u64x2 R[64];
 
-            uint32_t prev_offset;
-            if (curr_offset % lane_length == 0) {
-                prev_offset = curr_offset + lane_length - 1;
-            } else {
+            // Rows: R[8 * i + 0..7], starting from X ^ Y
+            for (unsigned i = 0; i < 8; ++i) {
+                u64x2 v[8];
+                for (unsigned k = 0; k < 8; ++k) {
+                    v[k] = load(X, 8 * i + k) ^ load(Y, 8 * i + k);
+                }
+                argon2_P(v);
+                for (unsigned k = 0; k < 8; ++k) {
+                    R[8 * i + k] = v[k];
+                }
+            }
+
+            // Columns: R[i + 8 * 0..7]
+            for (unsigned i = 0; i < 8; ++i) {
+                u64x2 v[8];
+                for (unsigned k = 0; k < 8; ++k) {
+                    v[k] = R[i + 8 * k];
+                }
+                argon2_P(v);
+                for (unsigned k = 0; k < 8; ++k) {
+                    R[i + 8 * k] = v[k];
+                }
+                if (i == 0 && early) {
+                    const uint64_t n = with_xor ? N.u64[0] : 0;
+                    early->callback(early->context, X.u64[0] ^ Y.u64[0] ^ n ^ R[0][0]);
+                }
+            }
+
+            // N = X ^ Y (^ N) ^ R
+            for (unsigned i = 0; i < 64; ++i) {
+                R[i] ^= load(X, i) ^ load(Y, i);
+                if (with_xor) {
+                    R[i] ^= load(N, i);
+                }
+            }
+            memcpy(&N, R, sizeof(R));
+        }
+
+        TARGET_SSSE3
+        static void blake2b_compress(uint64_t (&h)[8], const uint64_t (&m)[16], uint64_t t, bool is_last_block) {
+            Blake2b_rows<u64x4>::compress(h, m, t, is_last_block);
+        }
+
+        TARGET_SSSE3
+        static void hash_blocks(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length) {
+            Blake2b_words<u64x2>::hash_blocks(out, in, count, in_length);
+        }
+    };
+#endif
+
+
+#ifdef KERNEL_X86
+    // W / 4 permutations side by side, each register holds one row of four words per permutation.
+    // u64x4: AVX2, u64x8: AVX-512.
+    // Vectors are passed by reference, so that the helpers do not depend on the vector ABI of the target.
+    template <class V>
+    struct Kernel_wide {
+        static constexpr unsigned W = sizeof(V) / sizeof(uint64_t);
+        static constexpr unsigned instances = W / 4;
+
+        // Loads (r[base + 0], r[base + 1], r[base + pair_stride + 0], r[base + pair_stride + 1])
+        // for each permutation, the next permutation starting at base + instance_stride.
+        template <unsigned pair_stride, unsigned instance_stride>
+        [[gnu::always_inline]]
+        static void load(V &v, const uint64_t *r, unsigned base) {
+            u64x2 p[2 * instances];
+            for (unsigned n = 0; n < instances; ++n) {
+                memcpy(&p[2 * n + 0], &r[base + n * instance_stride], sizeof(u64x2));
+                memcpy(&p[2 * n + 1], &r[base + n * instance_stride + pair_stride], sizeof(u64x2));
+            }
+            if constexpr (W == 4) {
+                v = __builtin_shufflevector(p[0], p[1], 0, 1, 2, 3);
+            } else {
+                v = __builtin_shufflevector(
+                    __builtin_shufflevector(p[0], p[1], 0, 1, 2, 3),
+                    __builtin_shufflevector(p[2], p[3], 0, 1, 2, 3),
+                    0, 1, 2, 3, 4, 5, 6, 7
+                );
+            }
+        }
+
+        template <unsigned pair_stride, unsigned instance_stride>
+        [[gnu::always_inline]]
+        static void store(uint64_t *r, unsigned base, const V &v) {
+            u64x2 p[2 * instances];
+            if constexpr (W == 4) {
+                p[0] = __builtin_shufflevector(v, v, 0, 1);
+                p[1] = __builtin_shufflevector(v, v, 2, 3);
+            } else {
+                p[0] = __builtin_shufflevector(v, v, 0, 1);
+                p[1] = __builtin_shufflevector(v, v, 2, 3);
+                p[2] = __builtin_shufflevector(v, v, 4, 5);
+                p[3] = __builtin_shufflevector(v, v, 6, 7);
+            }
+            for (unsigned n = 0; n < instances; ++n) {
+                memcpy(&r[base + n * instance_stride], &p[2 * n + 0], sizeof(u64x2));
+                memcpy(&r[base + n * instance_stride + pair_stride], &p[2 * n + 1], sizeof(u64x2));
+            }
+        }
+
+        // Rotates each group of four words left by `amount` words.
+        template <unsigned amount>
+        [[gnu::always_inline]]
+        static void rotate_words(V &v) {
+            constexpr unsigned a = amount;
+            if constexpr (W == 4) {
+                v = __builtin_shufflevector(v, v, (0 + a) % 4, (1 + a) % 4, (2 + a) % 4, (3 + a) % 4);
+            } else {
+                v = __builtin_shufflevector(
+                    v, v,
+                    (0 + a) % 4, (1 + a) % 4, (2 + a) % 4, (3 + a) % 4,
+                    4 + (0 + a) % 4, 4 + (1 + a) % 4, 4 + (2 + a) % 4, 4 + (3 + a) % 4
+                );
+            }
+        }
+
+        // a = ror(a ^ b, amount)
+        template <unsigned amount>
+        [[gnu::always_inline]]
+        static void xor_ror(V &a, const V &b) {
+            V x = a ^ b;
+            a = (x >> amount) | (x << (64 - amount));
+        }
+
+        // a = fBlaMka(a, b)
+        [[gnu::always_inline]]
+        static void fBlaMka(V &a, const V &b) {
+            V xy;
+            mul_lo32(xy, a, b);
+            a = a + b + (xy + xy);
+        }
+
+        [[gnu::always_inline]]
+        static void G(V &a, V &b, V &c, V &d) {
+            fBlaMka(a, b);
+            xor_ror<32>(d, a);
+            fBlaMka(c, d);
+            xor_ror<24>(b, c);
+            fBlaMka(a, b);
+            xor_ror<16>(d, a);
+            fBlaMka(c, d);
+            xor_ror<63>(b, c);
+        }
+
+        [[gnu::always_inline]]
+        static void argon2_P(V &a, V &b, V &c, V &d) {
+            G(a, b, c, d);
+
+            rotate_words<1>(b);
+            rotate_words<2>(c);
+            rotate_words<3>(d);
+
+            G(a, b, c, d);
+
+            rotate_words<3>(b);
+            rotate_words<2>(c);
+            rotate_words<1>(d);
+        }
+
+        template <unsigned pair_stride, unsigned instance_stride>
+        [[gnu::always_inline]]
+        static void permute(uint64_t *r, unsigned base, unsigned quad_stride) {
+            V a, b, c, d;
+            load<pair_stride, instance_stride>(a, r, base + 0 * quad_stride);
+            load<pair_stride, instance_stride>(b, r, base + 1 * quad_stride);
+            load<pair_stride, instance_stride>(c, r, base + 2 * quad_stride);
+            load<pair_stride, instance_stride>(d, r, base + 3 * quad_stride);
+
+            argon2_P(a, b, c, d);
+
+            store<pair_stride, instance_stride>(r, base + 0 * quad_stride, a);
+            store<pair_stride, instance_stride>(r, base + 1 * quad_stride, b);
+            store<pair_stride, instance_stride>(r, base + 2 * quad_stride, c);
+            store<pair_stride, instance_stride>(r, base + 3 * quad_stride, d);
+        }
+
+        [[gnu::always_inline]]
+        static void load(V &v, const Block &B, unsigned i) {
+            memcpy(&v, &B.u64[W * i], sizeof(v));
+        }
+
+        // v = X ^ Y (^ N) ^ r, vector i of the new block
+        [[gnu::always_inline]]
+        static void result(
+            V &v, const uint64_t *r, const Block &N, const Block &X, const Block &Y, bool with_xor, unsigned i
+        ) {
+            V x, y;
+            memcpy(&v, &r[W * i], sizeof(v));
+            load(x, X, i);
+            load(y, Y, i);
+            v ^= x ^ y;
+            if (with_xor) {
+                V n;
+                load(n, N, i);
+                v ^= n;
+            }
+        }
+
+        [[gnu::always_inline]]
+        static void fill_block(Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early) {
+            constexpr unsigned vectors = sizeof(Block) / sizeof(V);
+            constexpr unsigned row_vectors = 16 * instances / W;
+
+            alignas(8 * W) uint64_t r[128];
+
+            // Rows: r[16 * i + 0..15], starting from X ^ Y
+            for (unsigned i = 0; i < 8; i += instances) {
+                for (unsigned k = 0; k < row_vectors; ++k) {
+                    const unsigned index = 16 * i / W + k;
+                    V x, y;
+                    load(x, X, index);
+                    load(y, Y, index);
+                    x ^= y;
+                    memcpy(&r[W * index], &x, sizeof(x));
+                }
+                permute<2, 16>(r, 16 * i, 4);
+            }
+
+            // Columns: r[2 * i + 16 * 0..7 + 0..1]
+            for (unsigned i = 0; i < 8; i += instances) {
+                permute<16, 2>(r, 2 * i, 32);
+                if (i == 0 && early) {
+                    const uint64_t n = with_xor ? N.u64[0] : 0;
+                    early->callback(early->context, X.u64[0] ^ Y.u64[0] ^ n ^ r[0]);
+                }
+            }
+
+            for (unsigned i = 0; i < vectors; ++i) {
+                V v;
+                result(v, r, N, X, Y, with_xor, i);
+                memcpy(&N.u64[W * i], &v, sizeof(v));
+            }
+        }
+    };
+
+    struct Kernel_avx2 {
+        static constexpr const char *name = "avx2";
+
+        TARGET_AVX2
+        static void fill_block(Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early) {
+            Kernel_wide<u64x4>::fill_block(N, X, Y, with_xor, early);
+        }
+
+        TARGET_AVX2
+        static void blake2b_compress(uint64_t (&h)[8], const uint64_t (&m)[16], uint64_t t, bool is_last_block) {
+            Blake2b_rows<u64x4>::compress(h, m, t, is_last_block);
+        }
+
+        TARGET_AVX2
+        static void hash_blocks(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length) {
+            Blake2b_words<u64x4>::hash_blocks(out, in, count, in_length);
+        }
+    };
+
+    struct Kernel_avx512 {
+        static constexpr const char *name = "avx512";
+
+        TARGET_AVX512
+        static void fill_block(Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early) {
+            Kernel_wide<u64x8>::fill_block(N, X, Y, with_xor, early);
+        }
+
+        TARGET_AVX512
+        static void blake2b_compress(uint64_t (&h)[8], const uint64_t (&m)[16], uint64_t t, bool is_last_block) {
+            Blake2b_rows<u64x4>::compress(h, m, t, is_last_block);
+        }
+
+        TARGET_AVX512
+        static void hash_blocks(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length) {
+            Blake2b_words<u64x8>::hash_blocks(out, in, count, in_length);
+        }
+    };
+#endif
+
+
+    struct Kernel {
+        using Fill_block = void (*)(Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early);
+        using Blake2b_compress = void (*)(uint64_t (&h)[8], const uint64_t (&m)[16], uint64_t t, bool is_last_block);
+        using Hash_blocks = void (*)(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length);
+
+        const char *name;
+        Fill_block fill_block;
+        Blake2b_compress blake2b_compress;
+        Hash_blocks hash_blocks;
+
+        template <class K>
+        static constexpr Kernel of() {
+            return { K::name, K::fill_block, K::blake2b_compress, K::hash_blocks };
+        }
+
+        static constexpr uint32_t max_count = 4;
+
+        // All kernels the current CPU supports, the best one first.
+        // Kernel_128 comes after Kernel_ref on x86, the native bench measures it slower than the scalar kernel there.
+        static uint32_t supported(Kernel (&kernels)[max_count]) {
+            uint32_t count = 0;
+#if defined(KERNEL_X86)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) {
+                kernels[count++] = of<Kernel_avx512>();
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                kernels[count++] = of<Kernel_avx2>();
+            }
+            kernels[count++] = of<Kernel_ref>();
+            if (__builtin_cpu_supports("ssse3")) {
+                kernels[count++] = of<Kernel_128>();
+            }
+#elif defined(KERNEL_128)
+            kernels[count++] = of<Kernel_128>();
+            kernels[count++] = of<Kernel_ref>();
+#else
+            kernels[count++] = of<Kernel_ref>();
+#endif
+            return count;
+        }
+
+#if !defined(__wasm__)
+        // The kernel that is named by the environment variable PASSWORDHASH_KERNEL, otherwise the best one.
+        static Kernel select() {
+            Kernel kernels[max_count];
+            const uint32_t count = supported(kernels);
+
+            const char *wanted = ::getenv("PASSWORDHASH_KERNEL");
+            for (uint32_t k = 0; wanted && k < count; ++k) {
+                if (__builtin_strcmp(wanted, kernels[k].name) == 0) {
+                    return kernels[k];
+                }
+            }
+            return kernels[0];
+        }
+#endif
+    };
+
+
+#if defined(BENCHMARK) || defined(CHECK)
+    // The benchmark and the conformance check go through every supported kernel in turn.
+#   define KERNEL_DISPATCH 1
+    Kernel kernel = Kernel::select();
+#elif defined(KERNEL_X86)
+#   define KERNEL_DISPATCH 1
+    const Kernel kernel = Kernel::select();
+#elif defined(KERNEL_128)
+    constexpr Kernel kernel = Kernel::of<Kernel_128>();
+#else
+    constexpr Kernel kernel = Kernel::of<Kernel_ref>();
+#endif
+
+
+    class Blake2b {
+    private:
+        struct {
+            uint64_t h[8];
+            uint64_t t;  // RFC: uint128_t
+            uint8_t buffer_length; // 0..128
+            union {
+                uint8_t bytes[128];
+                uint64_t words[16];
+            } buffer;
+        } S;
+
+        void compress(bool is_last_block) {
+#if defined(KERNEL_DISPATCH)
+            kernel.blake2b_compress(S.h, S.buffer.words, S.t, is_last_block);
+#elif defined(KERNEL_128)
+            Kernel_128::blake2b_compress(S.h, S.buffer.words, S.t, is_last_block);
+#else
+            Kernel_ref::blake2b_compress(S.h, S.buffer.words, S.t, is_last_block);
+#endif
+        }
+
+    public:
+        explicit Blake2b(uint32_t outlen) {
+            memcpy(S.h, blake2b_IV, sizeof(S.h));
+            S.h[0] ^= UINT64_C(0x01010000) | outlen;
+            S.t = 0;
+            S.buffer_length = 0;
+        }
+
+        void update(const void *in, uint32_t inlen) {
+            const uint8_t *c = reinterpret_cast<const uint8_t*>(in);
+            while (inlen) {
+                // A full buffer is only compressed if more data follows, the last block is compressed in finalize().
+                if (S.buffer_length == sizeof(S.buffer)) {
+                    S.buffer_length = 0;
+                    compress(false);
+                }
+
+                uint32_t cnt = min32(sizeof(S.buffer) - S.buffer_length, inlen);
+                memcpy(S.buffer.bytes + S.buffer_length, c, cnt);
+
+                S.buffer_length += cnt;
+                S.t += cnt;
+                inlen -= cnt;
+                c += cnt;
+            }
+        }
+
+        void finalize(void *out, uint32_t outlen) {
+            memset(S.buffer.bytes + S.buffer_length, 0, sizeof(S.buffer) - S.buffer_length);
+            compress(true);
+            memcpy(out, S.h, outlen);
+        }
+
+        // Clears the state, the buffer holds the last bytes of the message.
+        void wipe() {
+            memset(&S, 0, sizeof(S));
+            __asm__ __volatile__ ("" : : "r"(&S) : "memory");
+        }
+
+        static void hash(void *dest, uint32_t dest_len, std::initializer_list<SrcLen> src_lens) {
+            auto S = Blake2b{dest_len};
+            for (auto [src, src_len] : src_lens) {
+                S.update(src, src_len);
+            }
+            S.finalize(dest, dest_len);
+        }
+    };
+
+
+#ifdef ARGON2_THREADS
+#   if defined(__wasm__)
+    // Futex based lock on top of the WebAssembly atomics.
+    class Mutex {
+    private:
+        int32_t state = 0;  // 0: unlocked, 1: locked, 2: locked and contended
+
+        friend class Condition;
+
+    public:
+        void lock() {
+            int32_t c = 0;
+            if (__atomic_compare_exchange_n(&state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+            if (c != 2) {
+                c = __atomic_exchange_n(&state, 2, __ATOMIC_ACQUIRE);
+            }
+            while (c != 0) {
+                __builtin_wasm_memory_atomic_wait32(&state, 2, -1);
+                c = __atomic_exchange_n(&state, 2, __ATOMIC_ACQUIRE);
+            }
+        }
+
+        void unlock() {
+            if (__atomic_exchange_n(&state, 0, __ATOMIC_RELEASE) == 2) {
+                __builtin_wasm_memory_atomic_notify(&state, 1);
+            }
+        }
+    };
+
+    class Condition {
+    private:
+        int32_t sequence = 0;
+
+    public:
+        void wait(Mutex &mutex) {
+            int32_t seen = __atomic_load_n(&sequence, __ATOMIC_RELAXED);
+            mutex.unlock();
+            __builtin_wasm_memory_atomic_wait32(&sequence, seen, -1);
+            mutex.lock();
+        }
+
+        void broadcast() {
+            __atomic_fetch_add(&sequence, 1, __ATOMIC_RELEASE);
+            __builtin_wasm_memory_atomic_notify(&sequence, ~0u);
+        }
+    };
+#   else
+    class Mutex {
+    private:
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+        friend class Condition;
+
+    public:
+        void lock() {
+            pthread_mutex_lock(&mutex);
+        }
+
+        void unlock() {
+            pthread_mutex_unlock(&mutex);
+        }
+    };
+
+    class Condition {
+    private:
+        pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+    public:
+        void wait(Mutex &mutex) {
+            pthread_cond_wait(&cond, &mutex.mutex);
+        }
+
+        void broadcast() {
+            pthread_cond_broadcast(&cond);
+        }
+    };
+#   endif
+
+
+    // Persistent worker threads. The calling thread takes part in the work, too.
+    // Natively the pool starts its threads itself, in WebAssembly the host has to start workers,
+    // that call worker_main().
+    class Thread_pool {
+    public:
+        using Task = void (*)(void *context, uint32_t index);
+
+    private:
+        // A call of run(), on the stack of its caller.
+        struct Run {
+            Task task;
+            void *context;
+            uint32_t count;
+
+            // guarded by mutex:
+            uint32_t next;      // the first index that nobody has taken yet
+            uint32_t finished;
+            Run *later;
+        };
+
+        static inline Mutex mutex;
+        static inline Condition work_cond;  // a run was queued
+        static inline Condition done_cond;  // a task of a run finished
+
+        // guarded by mutex:
+        static inline uint32_t threads = 0;
+        // The runs with indices that nobody has taken yet, the oldest first.
+        static inline Run *first = nullptr;
+        static inline Run *last = nullptr;
+
+        // Called with mutex held. Computes the indices of the run that nobody has taken yet, one at a time.
+        static void work(Run &run) {
+            while (run.next < run.count) {
+                const uint32_t index = run.next++;
+                if (run.next == run.count) {
+                    dequeue(run);
+                }
+                mutex.unlock();
+
+                run.task(run.context, index);
+
+                mutex.lock();
+                if (++run.finished == run.count) {
+                    done_cond.broadcast();
+                }
+            }
+        }
+
+        // Called with mutex held.
+        static void enqueue(Run &run) {
+            run.later = nullptr;
+            if (last) {
+                last->later = &run;
+            } else {
+                first = &run;
+            }
+            last = &run;
+        }
+
+        // Called with mutex held.
+        static void dequeue(Run &run) {
+            Run **link = &first;
+            Run *previous = nullptr;
+            while (*link != &run) {
+                previous = *link;
+                link = &previous->later;
+            }
+            *link = run.later;
+            if (last == &run) {
+                last = previous;
+            }
+        }
+
+#   if !defined(__wasm__)
+        static void *worker(void *) {
+            worker_main();
+            return nullptr;
+        }
+#   endif
+
+        // Called with mutex held.
+        static void spawn(uint32_t wanted) {
+#   if defined(__wasm__)
+            (void) wanted;
+#   else
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            if (cpus > 0 && wanted > static_cast<uint32_t>(cpus) - 1) {
+                wanted = static_cast<uint32_t>(cpus) - 1;
+            }
+            while (threads < wanted) {
+                pthread_t thread;
+                if (pthread_create(&thread, nullptr, worker, nullptr) != 0) {
+                    break;
+                }
+                pthread_detach(thread);
+                ++threads;
+            }
+#   endif
+        }
+
+    public:
+        // Never returns.
+        static void worker_main() {
+            mutex.lock();
+#   if defined(__wasm__)
+            ++threads;
+#   endif
+            while (true) {
+                while (!first) {
+                    work_cond.wait(mutex);
+                }
+                work(*first);
+            }
+        }
+
+        // Runs task(context, 0) .. task(context, count - 1), and returns when all of them are done.
+        // Concurrent runs are queued: the threads of the pool take the indices of the oldest run first,
+        // and every caller computes indices of its own run until none are left.
+        static void run(uint32_t count, Task task, void *context) {
+            if (count <= 1) {
+                for (uint32_t index = 0; index < count; ++index) {
+                    task(context, index);
+                }
+                return;
+            }
+
+            Run run = { task, context, count, 0, 0, nullptr };
+            mutex.lock();
+            spawn(count - 1);
+            enqueue(run);
+            work_cond.broadcast();
+
+            work(run);
+            while (run.finished < run.count) {
+                done_cond.wait(mutex);
+            }
+            mutex.unlock();
+        }
+    };
+#endif
+
+
+#if defined(__wasm__)
+    extern "C" uint8_t __heap_base;
+#endif
+
+    // The blocks are only allocated when the first hash needs them. The request is read from B, too.
+    // Natively every Memory owns a mapping of its own. In WebAssembly the blocks start at __heap_base,
+    // so there can only be one Memory per instance.
+    class Memory {
+    private:
+        uint32_t capacity = 0;  // in blocks
+        uint32_t used = 0;  // in blocks, since the last wipe()
+
+#if !defined(__wasm__)
+        size_t mapped = 0;  // in bytes, at least capacity blocks
+
+        static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+        static constexpr size_t page_size = 4 * 1024;
+
+        // The references of the first pass are random, so nearly every block would cost a TLB miss with small pages.
+        // Large mappings are aligned to huge pages, so that transparent huge pages can back all of them.
+        uint8_t *map_aligned(size_t length) {
+            if (length < huge_page_size) {
+                void *blocks = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                mapped = length;
+                return blocks != MAP_FAILED ? reinterpret_cast<uint8_t*>(blocks) : nullptr;
+            }
+
+            length = (length + huge_page_size - 1) & ~(huge_page_size - 1);
+#   ifdef MAP_HUGETLB
+            if (flags & ARGON2_MEMORY_HUGETLB) {
+                // Only succeeds if the administrator reserved enough huge pages.
+                void *blocks = ::mmap(
+                    nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+                );
+                if (blocks != MAP_FAILED) {
+                    mapped = length;
+                    return reinterpret_cast<uint8_t*>(blocks);
+                }
+            }
+#   endif
+
+            void *area = ::mmap(
+                nullptr, length + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+            );
+            if (area == MAP_FAILED) {
+                return nullptr;
+            }
+
+            // Trim the area to the aligned part.
+            uint8_t *start = reinterpret_cast<uint8_t*>(area);
+            uint8_t *blocks = reinterpret_cast<uint8_t*>(
+                (reinterpret_cast<uintptr_t>(start) + huge_page_size - 1) & ~(huge_page_size - 1)
+            );
+            if (blocks > start) {
+                ::munmap(start, static_cast<size_t>(blocks - start));
+            }
+            if (start + huge_page_size > blocks) {
+                ::munmap(blocks + length, static_cast<size_t>(start + huge_page_size - blocks));
+            }
+            mapped = length;
+
+#   ifdef MADV_HUGEPAGE
+            ::madvise(blocks, length, MADV_HUGEPAGE);
+#   endif
+            return blocks;
+        }
+
+        void *map(size_t length) {
+            uint8_t *blocks = map_aligned(length);
+            if (blocks && (flags & ARGON2_MEMORY_PREFAULT)) {
+                // The pages are zero, so writing a zero faults them in, outside of the timed hash.
+                for (size_t offset = 0; offset < mapped; offset += page_size) {
+                    *reinterpret_cast<volatile uint8_t*>(blocks + offset) = 0;
+                }
+            }
+            return blocks;
+        }
+#endif
+
+    public:
+        Block *B = nullptr;
+
+#if !defined(__wasm__)
+        // ARGON2_MEMORY_HUGETLB and ARGON2_MEMORY_PREFAULT, for the next mapping.
+        uint32_t flags = 0;
+#endif
+
+        uint64_t bytes() const {
+            return static_cast<uint64_t>(capacity) * sizeof(Block);
+        }
+
+        // Makes room for at least block_count blocks. The first keep_length bytes of B are retained.
+        bool reserve(uint32_t block_count, uint32_t keep_length) {
+            if (block_count <= capacity) {
+                used = used >= block_count ? used : block_count;
+                return true;
+            }
+
+#if defined(__wasm__)
+            // The blocks start at the end of the static data, and the memory is grown to fit them.
+            // It never moves, so nothing has to be copied.
+            (void) keep_length;
+
+            constexpr uint64_t page_size = 64 * 1024;
+            const uintptr_t base = (
+                (reinterpret_cast<uintptr_t>(&__heap_base) + alignof(Block) - 1) & ~(alignof(Block) - 1)
+            );
+            const uint64_t end = base + static_cast<uint64_t>(block_count) * sizeof(Block);
+            const uint64_t current = static_cast<uint64_t>(__builtin_wasm_memory_size(0)) * page_size;
+            if (end > current) {
+                const size_t pages = static_cast<size_t>((end - current + page_size - 1) / page_size);
+                if (__builtin_wasm_memory_grow(0, pages) == static_cast<size_t>(-1)) {
+                    return false;
+                }
+            }
+
+            B = reinterpret_cast<Block*>(base);
+#else
+            const size_t old_mapped = mapped;
+            void *blocks = map(static_cast<size_t>(block_count) * sizeof(Block));
+            if (!blocks) {
+                mapped = old_mapped;
+                return false;
+            }
+
+            if (B) {
+                memcpy(blocks, B, keep_length < bytes() ? keep_length : bytes());
+                ::munmap(B, old_mapped);
+            }
+            B = reinterpret_cast<Block*>(blocks);
+#endif
+            capacity = block_count;
+            used = block_count;
+            return true;
+        }
+
+        // Clears the request, the blocks and the tag. Only the blocks that were used since the last call are
+        // touched, not the whole capacity.
+        void wipe() {
+            if (B && used) {
+                memset(B, 0, static_cast<size_t>(used) * sizeof(Block));
+                // The blocks are not read again, but they must not be optimized away.
+                __asm__ __volatile__ ("" : : : "memory");
+            }
+            used = 0;
+        }
+
+#if !defined(__wasm__)
+        // The memory of a WebAssembly instance cannot shrink. The host has to drop the instance instead.
+        void release() {
+            if (B) {
+                ::munmap(B, mapped);
+                B = nullptr;
+                capacity = 0;
+                used = 0;
+                mapped = 0;
+            }
+        }
+#endif
+    };
+
+
+#if defined(ARGON2_THREADS) && defined(__wasm__)
+    // Every worker instance needs a stack of its own in the shared memory.
+    // The host sets __stack_pointer to thread_stacks + (index + 1) * thread_stack_layout[0].
+
+    static inline constexpr uint32_t thread_stack_size = 64 * 1024;
+    static inline constexpr uint32_t max_threads = 8;
+
+    __attribute__((visibility("default")))
+    extern "C" const uint32_t thread_stack_layout[2] = { thread_stack_size, max_threads };
+
+    __attribute__((visibility("default")))
+    extern "C" alignas(16) uint8_t thread_stacks[max_threads][thread_stack_size] = {};
+#endif
+
+
+    class Argon2 {
+    private:
+        static void hash(
+            void *digest_, uint32_t digest_length,
+            const void *message_, uint32_t message_length
+        ) {
+            uint8_t *digest = reinterpret_cast<uint8_t*>(digest_);
+            const uint8_t *message = reinterpret_cast<const uint8_t*>(message_);
+
+            if (digest_length <= 64) {
+                Blake2b::hash(digest_, digest_length, {
+                    { &digest_length, sizeof(digest_length) },
+                    { message, message_length },
+                });
+            } else {
+                alignas(512 / 8) uint8_t V1[64];
+                Blake2b::hash(V1, sizeof(V1), {
+                    { &digest_length, sizeof(digest_length) },
+                    { message, message_length },
+                });
+
+                while (true) {
+                    memcpy(digest, V1, 32);
+                    digest += 32;
+                    digest_length -= 32;
+                    if (digest_length <= 64) {
+                        break;
+                    }
+                    Blake2b::hash(V1, sizeof(V1), {
+                        { V1, sizeof(V1) },
+                    });
+                }
+
+                Blake2b::hash(digest, digest_length, {
+                    { V1, sizeof(V1) },
+                });
+            }
+        }
+
+        static void fill_block(
+            Block &N, const Block &X, const Block &Y, bool with_xor, const Early_word *early = nullptr
+        ) {
+#if defined(KERNEL_DISPATCH)
+            kernel.fill_block(N, X, Y, with_xor, early);
+#elif defined(KERNEL_128)
+            Kernel_128::fill_block(N, X, Y, with_xor, early);
+#else
+            Kernel_ref::fill_block(N, X, Y, with_xor, early);
+#endif
+        }
+
+        static void hash_blocks(Block *const *out, const uint8_t *const *in, uint32_t count, uint32_t in_length) {
+#if defined(KERNEL_DISPATCH)
+            kernel.hash_blocks(out, in, count, in_length);
+#elif defined(KERNEL_128)
+            Kernel_128::hash_blocks(out, in, count, in_length);
+#else
+            Kernel_ref::hash_blocks(out, in, count, in_length);
+#endif
+        }
+
+        static void prefetch(const Block &block) {
+            for (uint32_t offset = 0; offset < sizeof(Block); offset += 64) {
+                __builtin_prefetch(block.bytes + offset);
+            }
+        }
+
+        // Argon2i and the first half of the first pass of Argon2id don't use the content of the previous
+        // block to select the reference block, but a counter based pseudo-random stream.
+        // One address block holds the pseudo-random values of 128 blocks.
+        struct Address_block {
+            static constexpr uint32_t count = sizeof(Block) / sizeof(uint64_t);
+
+            Block input;
+            Block addresses;
+
+            template <class Shape>
+            void initialize(const Shape &shape, Argon2_type type, uint32_t pass_r, uint32_t slice_s, uint32_t lane) {
+                input = {};
+                input.u64[0] = pass_r;
+                input.u64[1] = lane;
+                input.u64[2] = slice_s;
+                input.u64[3] = shape.lanes * shape.lane_length;
+                input.u64[4] = shape.iterations;
+                input.u64[5] = static_cast<uint32_t>(type);
+            }
+
+            void skip(uint32_t address_blocks) {
+                input.u64[6] += address_blocks;
+            }
+
+            void next() {
+                static const Block zero = {};
+
+                Block temp;
+                ++input.u64[6];
+                fill_block(temp, zero, input, false);
+                fill_block(addresses, zero, temp, false);
+            }
+        };
+
+        // Position of the reference block inside its lane.
+        template <class Shape>
+        static uint32_t index_alpha(
+            const Shape &shape, uint32_t pass_r, uint32_t slice_s, uint32_t index, uint32_t pseudo_rand, bool same_lane
+        ) {
+            uint32_t reference_area_size;
+            if (pass_r > 0) {
+                if (same_lane) {
+                    reference_area_size = shape.lane_length - shape.segment_length + index - 1;
+                } else {
+                    reference_area_size = shape.lane_length - shape.segment_length - (index == 0 ? 1 : 0);
+                }
+            } else if (slice_s == 0) {
+                // First pass, first slice: only the own lane
+                reference_area_size = index - 1;
+            } else if (same_lane) {
+                // First pass
+                reference_area_size = slice_s * shape.segment_length + index - 1;
+            } else {
+                // First pass, other lane: only finished segments
+                reference_area_size = slice_s * shape.segment_length - (index == 0 ? 1 : 0);
+            }
+
+            uint64_t relative_position = pseudo_rand;
+            relative_position = (relative_position * relative_position) >> 32;
+            relative_position = reference_area_size - 1 - ((reference_area_size * relative_position) >> 32);
+
+            uint32_t start_position = 0;
+            if (pass_r > 0 && slice_s != sync_points - 1) {
+                start_position = (slice_s + 1) * shape.segment_length;
+            }
+
+            uint32_t absolute_position = (start_position + relative_position) % shape.lane_length;
+            return absolute_position;
+        }
+
+        static void initialize(Block *B, const Params &params, std::initializer_list<SrcLen> src_lens) {
+            // Generate initial 64-byte block H0.
+            uint8_t H0[64];
+            Blake2b::hash(H0, sizeof(H0), src_lens);
+            initialize(B, params, H0);
+        }
+
+        static void initialize(Block *B, const Params &params, const uint8_t (&H0)[64]) {
+            struct __attribute__((packed)) Input {
+                uint8_t H0[64];
+                uint32_t block_no;
+                uint32_t lane_no;
+            };
+
+#ifdef GENKAT
+            print_hex("Pre-hashing digest", H0, sizeof(H0));
+#endif
+
+            // Compute the first and second block (i.e. column zero and one) of every lane.
+            // The inputs only differ in their last 8 bytes, so they are hashed side by side.
+            constexpr uint32_t batch = 16;
+            alignas(512 / 8) Input data[batch];
+            const uint8_t *in[batch];
+            Block *out[batch];
+
+            const uint32_t count = 2 * params.lanes;
+            for (uint32_t first = 0; first < count; first += batch) {
+                const uint32_t batch_count = min32(batch, count - first);
+                for (uint32_t n = 0; n < batch_count; ++n) {
+                    const uint32_t lane = (first + n) / 2;
+                    const uint32_t block_no = (first + n) % 2;
+                    memcpy(data[n].H0, H0, sizeof(H0));
+                    data[n].block_no = block_no;
+                    data[n].lane_no = lane;
+                    in[n] = reinterpret_cast<const uint8_t*>(&data[n]);
+                    out[n] = &B[lane * params.lane_length + block_no];
+                }
+                hash_blocks(out, in, batch_count, sizeof(Input));
+            }
+        }
+
+        // Fills the blocks [begin, end) of a segment.
+        template <class Shape>
+        static void fill_segment(
+            Block *B, const Shape &shape, Argon2_type type, uint32_t pass_r, uint32_t slice_s, uint32_t lane,
+            uint32_t begin, uint32_t end
+        ) {
+            uint32_t starting_index = begin;
+            if (pass_r == 0 && slice_s == 0 && starting_index < 2) {
+                starting_index = 2;
+            }
+
+            const bool data_independent = (
+                (type == Argon2_type::i) ||
+                (type == Argon2_type::id && pass_r == 0 && slice_s < sync_points / 2)
+            );
+
+            Address_block address_block;
+            uint64_t next_pseudo_rand = 0;
+            if (data_independent && starting_index < end) {
+                address_block.initialize(shape, type, pass_r, slice_s, lane);
+                address_block.skip(starting_index / Address_block::count);
+                address_block.next();
+                next_pseudo_rand = address_block.addresses.u64[starting_index % Address_block::count];
+            }
+
+            auto reference_block = [&](uint32_t index, uint64_t pseudo_rand) -> Block & {
+                uint32_t ref_lane = lane;
+                if (pass_r > 0 || slice_s > 0) {
+                    ref_lane = static_cast<uint32_t>(pseudo_rand >> 32) % shape.lanes;
+                }
+
+                uint32_t ref_index = index_alpha(
+                    shape, pass_r, slice_s, index, static_cast<uint32_t>(pseudo_rand), ref_lane == lane
+                );
+                return B[ref_lane * shape.lane_length + ref_index];
+            };
+
+            // Argon2d: the next reference block depends on the first word of the current block.
+            // The kernel reports it early, so that the reference block is loaded while the current block is finished.
+            struct Lookahead {
+                decltype(reference_block) &select;
+                uint32_t index;
+            } lookahead = { reference_block, 0 };
+
+            const Early_word early = {
+                [](const void *context, uint64_t word) {
+                    const Lookahead &lookahead = *reinterpret_cast<const Lookahead*>(context);
+                    prefetch(lookahead.select(lookahead.index, word));
+                },
+                &lookahead,
+            };
+
+            uint32_t curr_offset = lane * shape.lane_length + slice_s * shape.segment_length + starting_index;
+
+            uint32_t prev_offset;
+            if (curr_offset % shape.lane_length == 0) {
+                prev_offset = curr_offset + shape.lane_length - 1;
+            } else {
                 prev_offset = curr_offset - 1;
             }
 
-            for (uint32_t i = starting_index; i < segment_length; ++i, ++curr_offset, ++prev_offset) {
-                if (curr_offset % lane_length == 1) {
-                    prev_offset = curr_offset - 1;
+            for (uint32_t i = starting_index; i < end; ++i, ++curr_offset, ++prev_offset) {
+                if (curr_offset % shape.lane_length == 1) {
+                    prev_offset = curr_offset - 1;
+                }
+
+                const bool has_next = i + 1 < end;
+                uint64_t pseudo_rand;
+                if (data_independent) {
+                    pseudo_rand = next_pseudo_rand;
+
+                    // All pseudo-random values are known in advance, the next address block is computed before it
+                    // is needed. So the next reference block is always loaded while this block is computed.
+                    if (has_next) {
+                        const uint32_t next_address_index = (i + 1) % Address_block::count;
+                        if (next_address_index == 0) {
+                            address_block.next();
+                        }
+                        next_pseudo_rand = address_block.addresses.u64[next_address_index];
+                        prefetch(reference_block(i + 1, next_pseudo_rand));
+                    }
+                } else {
+                    pseudo_rand = B[prev_offset].u64[0];
+                    lookahead.index = i + 1;
+                }
+
+                Block &curr_block = B[curr_offset];
+                Block &prev_block = B[prev_offset];
+                Block &ref_block = reference_block(i, pseudo_rand);
+                const Early_word *next_reference = !data_independent && has_next ? &early : nullptr;
+                fill_block(curr_block, prev_block, ref_block, (pass_r > 0), next_reference);
+            }
+        }
+
+        template <class Shape>
+        struct Slice {
+            Block *B;
+            const Shape &shape;
+            Argon2_type type;
+            uint32_t pass_r;
+            uint32_t slice_s;
+            uint32_t begin;
+            uint32_t end;
+        };
+
+        template <class Shape>
+        static void fill_slice_lane(void *slice_, uint32_t lane) {
+            const Slice<Shape> &slice = *reinterpret_cast<const Slice<Shape>*>(slice_);
+            fill_segment(slice.B, slice.shape, slice.type, slice.pass_r, slice.slice_s, lane, slice.begin, slice.end);
+        }
+
+        // All lanes of a slice can be computed in parallel, the slices are sync points.
+        template <class Shape>
+        static void fill_slice(
+            Block *B, const Shape &shape, Argon2_type type, uint32_t pass_r, uint32_t slice_s,
+            uint32_t begin, uint32_t end
+        ) {
+            Slice<Shape> slice = { B, shape, type, pass_r, slice_s, begin, end };
+#ifdef ARGON2_THREADS
+            Thread_pool::run(shape.lanes, fill_slice_lane<Shape>, &slice);
+#else
+            for (uint32_t lane = 0; lane < shape.lanes; ++lane) {
+                fill_slice_lane<Shape>(&slice, lane);
+            }
+#endif
+        }
+
+        template <class Shape>
+        static void run(Block *B, const Shape &shape, Argon2_type type) {
+            for (uint32_t pass_r = 0; pass_r < shape.iterations; ++pass_r) {
+                for (uint32_t slice_s = 0; slice_s < sync_points; ++slice_s) {
+                    fill_slice(B, shape, type, pass_r, slice_s, 0, shape.segment_length);
+                }
+#if GENKAT
+#   if 0
+                ::printf("\n After pass %d:\n", pass_r);
+                for (uint32_t block_no = 0; block_no < shape.lanes * shape.lane_length; ++block_no) {
+                    for (uint32_t int_no = 0; int_no < 128; ++int_no) {
+                        ::printf(
+                            "Block %04d [%3d]: %016llx\n",
+                            (unsigned) block_no,
+                            (unsigned) int_no,
+                            (unsigned long long) B[block_no].u64[int_no]
+                        );
+                    }
+                }
+#   endif
+#endif
+            }
+        }
+
+        // A hash that is computed by repeated calls to step().
+        struct Position {
+            uint32_t pass_r;
+            uint32_t slice_s;
+            uint32_t index;
+        };
+
+        // The entry points of the hashing loop of one of the Fixed_shapes.
+        struct Specialization {
+            bool (*matches)(const Params &params);
+            void (*run)(Block *B, Argon2_type type);
+            void (*fill_slice)(Block *B, Argon2_type type, const Position &position, uint32_t end);
+        };
+
+        template <class Shape>
+        static void run_fixed(Block *B, Argon2_type type) {
+            run(B, Shape{}, type);
+        }
+
+        template <class Shape>
+        static void fill_slice_fixed(Block *B, Argon2_type type, const Position &position, uint32_t end) {
+            fill_slice(B, Shape{}, type, position.pass_r, position.slice_s, position.index, end);
+        }
+
+        template <class List>
+        struct Dispatch;
+
+        template <class... Shapes>
+        struct Dispatch<Shape_list<Shapes...>> {
+            static constexpr Specialization table[] = {
+                { Shapes::matches, run_fixed<Shapes>, fill_slice_fixed<Shapes> }...
+            };
+        };
+
+        // The first fixed shape that matches the parameters of the request, or null for the generic loop.
+        static const Specialization *specialization(const Params &params) {
+#ifdef CHECK
+            if (generic_only) {
+                return nullptr;
+            }
+#endif
+            for (const Specialization &fixed : Dispatch<Fixed_shapes>::table) {
+                if (fixed.matches(params)) {
+                    return &fixed;
+                }
+            }
+            return nullptr;
+        }
+
+        static void run(Block *B, const Params &params) {
+            if (const Specialization *fixed = specialization(params)) {
+                fixed->run(B, params.type);
+            } else {
+                run(B, Dynamic_shape{params}, params.type);
+            }
+        }
+
+        static void fill_slice(Block *B, const Params &params, const Position &position, uint32_t end) {
+            if (const Specialization *fixed = specialization(params)) {
+                fixed->fill_slice(B, params.type, position, end);
+            } else {
+                fill_slice(
+                    B, Dynamic_shape{params}, params.type, position.pass_r, position.slice_s, position.index, end
+                );
+            }
+        }
+
+        static void finalize(Block *B, const Params &params) {
+            // XOR the last blocks of all lanes into the last block of lane 0.
+            Block &last = B[params.lane_length - 1];
+            for (uint32_t lane = 1; lane < params.lanes; ++lane) {
+                const Block &other = B[lane * params.lane_length + params.lane_length - 1];
+                for (unsigned i = 0; i < 128; ++i) {
+                    last.u64[i] ^= other.u64[i];
+                }
+            }
+
+            hash(B, params.tag_length, last.bytes, sizeof(Block));
+        }
+
+        // The state of one hash. Natively every context can be used by another thread at the same time.
+        Memory memory = {};
+        Params step_params = {};
+        Position step_position = {};
+        bool step_active = false;
+
+        // A pre-hash that is fed in pieces.
+        Blake2b prehash = Blake2b{64};
+        Params prehash_params = {};
+        uint32_t prehash_fields = 0;  // started inputs: password, salt, key, associated data
+        uint32_t prehash_remaining = 0;  // bytes of the current input
+        bool prehash_active = false;
+
+        bool prehash_abort() {
+            prehash.wipe();
+            prehash_fields = 0;
+            prehash_remaining = 0;
+            prehash_active = false;
+            return false;
+        }
+
+        // Computes the first blocks of every lane from the inputs.
+        bool prepare(
+            Params &params,
+            uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+            uint32_t hash_type,
+            const void *password, uint32_t password_length,
+            const void *salt, uint32_t salt_length,
+            const void *key, uint32_t key_length,
+            const void *associated_data, uint32_t associated_data_length
+        ) {
+            if (
+                !params.set(parallelism, tag_length, memory_size_kb, iterations, hash_type) ||
+                (!password && password_length > 0) ||
+                (!salt || salt_length < 8) ||
+                (!key && key_length > 0) ||
+                (!associated_data && associated_data_length > 0) ||
+                !memory.reserve(params.lanes * params.lane_length, 0)
+            ) {
+                return false;
+            }
+
+            initialize(memory.B, params, {
+                { &parallelism, sizeof(parallelism) },
+                { &tag_length, sizeof(tag_length) },
+                { &memory_size_kb, sizeof(memory_size_kb) },
+                { &iterations, sizeof(iterations) },
+                { &version, sizeof(version) },
+                { &hash_type, sizeof(hash_type) },
+
+                { &password_length, sizeof(password_length) },
+                { password, password_length },
+
+                { &salt_length, sizeof(salt_length) },
+                { salt, salt_length },
+
+                { &key_length, sizeof(key_length) },
+                { key, key_length },
+
+                { &associated_data_length, sizeof(associated_data_length) },
+                { associated_data, associated_data_length },
+            });
+            return true;
+        }
+
+        // Reads the request from B, and computes the first blocks of every lane.
+        bool prepare(uint32_t buffer_length, Params &params) {
+            const uint32_t min_buffer_length = (
+                sizeof(uint32_t) +  // parallelism
+                sizeof(uint32_t) +  // tag_length
+                sizeof(uint32_t) +  // memory_size_kb
+                sizeof(uint32_t) +  // iterations
+                sizeof(uint32_t) +  // version
+                sizeof(uint32_t) +  // hash_type
+                sizeof(uint32_t) +  // password_length
+                0                +  // password
+                sizeof(uint32_t) +  // salt_length
+                8                +  // salt
+                sizeof(uint32_t) +  // key_length
+                0                +  // key
+                sizeof(uint32_t) +  // associated_data_length
+                0                   // associated_data
+            );
+            if (buffer_length < min_buffer_length || buffer_length > memory.bytes()) {
+                return false;
+            }
+
+            const uint8_t *buffer = reinterpret_cast<const uint8_t*>(memory.B);
+            uint32_t buffer_pos = 0;
+
+            auto buffer_incrementable = [&](uint32_t count) -> bool {
+                return (
+                    (buffer_pos + count >= buffer_pos) &&
+                    (buffer_pos + count >= count) &&
+                    (buffer_pos + count <= buffer_length)
+                );
+            };
+
+            auto buffer_increment = [&](uint32_t count) -> bool {
+                if (!buffer_incrementable(count)) {
+                    return false;
+                }
+
+                buffer_pos += count;
+                return true;
+            };
+
+            auto buffer_read_u32 = [&](uint32_t &out) -> bool {
+                if (!buffer_incrementable(sizeof(uint32_t))) {
+                    return false;
+                }
+
+                memcpy(&out, buffer + buffer_pos, sizeof(uint32_t));
+                buffer_pos += sizeof(uint32_t);
+                return true;
+            };
+
+            auto buffer_read_u32_exact = [&](uint32_t expected) -> bool {
+                uint32_t actual;
+                return buffer_read_u32(actual) && expected == actual;
+            };
+
+            auto buffer_read_str = [&](uint32_t min_length) -> bool {
+                uint32_t count;
+                return buffer_read_u32(count) && (count >= min_length) && buffer_increment(count);
+            };
+
+            uint32_t parallelism, tag_length, memory_size_kb, iterations, hash_type;
+            if (
+                !buffer_read_u32(parallelism) ||
+                !buffer_read_u32(tag_length) ||
+                !buffer_read_u32(memory_size_kb) ||
+                !buffer_read_u32(iterations) ||
+                !buffer_read_u32_exact(version) ||
+                !buffer_read_u32(hash_type) ||
+                !params.set(parallelism, tag_length, memory_size_kb, iterations, hash_type) ||
+                !buffer_read_str(0) ||  // password
+                !buffer_read_str(8) ||  // salt
+                !buffer_read_str(0) ||  // key
+                !buffer_read_str(0) ||  // associated_data
+                !(buffer_pos == buffer_length) ||
+                !memory.reserve(params.lanes * params.lane_length, buffer_length) ||
+                false
+            ) {
+                return false;
+            }
+
+            // B might have moved.
+            buffer = reinterpret_cast<const uint8_t*>(memory.B);
+
+            initialize(memory.B, params, {
+                { buffer, buffer_length },
+            });
+            return true;
+        }
+
+    public:
+#ifdef CHECK
+        // The conformance check compares the loops of the fixed shapes against the generic one.
+        static inline bool generic_only = false;
+#endif
+
+        [[gnu::unused]]
+        static const char *kernel_name() {
+            return kernel.name;
+        }
+
+        // Returns where the host has to put a request of buffer_length bytes, or null if there is not enough memory.
+        // The tag is written to the same place.
+        void *buffer(uint32_t buffer_length) {
+            uint32_t block_count = buffer_length / sizeof(Block) + (buffer_length % sizeof(Block) != 0);
+            if (!memory.reserve(block_count, 0)) {
+                return nullptr;
+            }
+            return memory.B;
+        }
+
+        // The tag of the last hash, at the start of buffer().
+        const void *tag() const {
+            return memory.B;
+        }
+
+        // The length of the tag of the last hash that was computed by argon2_step().
+        uint32_t step_tag_length() const {
+            return step_params.tag_length;
+        }
+
+        // Clears everything the last requests left in the memory.
+        void wipe() {
+            memory.wipe();
+            prehash_abort();
+        }
+
+#if !defined(__wasm__)
+        void release() {
+            memory.release();
+        }
+
+        void set_memory_flags(uint32_t flags) {
+            memory.flags = flags;
+        }
+#endif
+
+        [[gnu::unused]]
+        bool argon2_hash(uint32_t buffer_length) {
+            Params params;
+            if (!prepare(buffer_length, params)) {
+                return false;
+            }
+
+            run(memory.B, params);
+            finalize(memory.B, params);
+            return true;
+        }
+
+        // Like argon2_hash(uint32_t), but the blocks are computed by calls to argon2_step().
+        [[gnu::unused]]
+        bool argon2_start(uint32_t buffer_length) {
+            step_active = prepare(buffer_length, step_params);
+            step_position = {};
+            return step_active;
+        }
+
+        // Computes at most max_blocks blocks per lane (0 = the rest of the slice), but never crosses a slice.
+        // Returns the finished fraction of the work, 1 if the tag is written to B, or a negative value if no
+        // hash was started.
+        [[gnu::unused]]
+        double argon2_step(uint32_t max_blocks) {
+            if (!step_active) {
+                return -1;
+            }
+
+            const Params &params = step_params;
+            Position &position = step_position;
+
+            uint32_t end = params.segment_length;
+            if (max_blocks > 0 && max_blocks < end - position.index) {
+                end = position.index + max_blocks;
+            }
+            fill_slice(memory.B, params, position, end);
+
+            position.index = end;
+            if (position.index == params.segment_length) {
+                position.index = 0;
+                if (++position.slice_s == sync_points) {
+                    position.slice_s = 0;
+                    ++position.pass_r;
+                }
+            }
+
+            if (position.pass_r == params.iterations) {
+                finalize(memory.B, params);
+                step_active = false;
+                return 1;
+            }
+
+            const double done = (
+                (static_cast<double>(position.pass_r) * sync_points + position.slice_s) * params.segment_length +
+                position.index
+            );
+            return done / (static_cast<double>(params.iterations) * sync_points * params.segment_length);
+        }
+
+        // The pass that the next argon2_step() computes, or the number of passes once the hash is finished.
+        [[gnu::unused]]
+        uint32_t argon2_step_pass() const {
+            return step_position.pass_r;
+        }
+
+        // Like argon2_start(), but the inputs are not read from a request in B. They are fed in pieces instead:
+        // every input (password, salt, key, associated data) is announced with its length by prehash_field(),
+        // followed by prehash_update() calls with its bytes. prehash_finish() computes the first blocks, the rest
+        // is computed by argon2_step(). A call out of order drops the pre-hash and returns false.
+        [[gnu::unused]]
+        bool prehash_start(
+            uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+            uint32_t hash_type
+        ) {
+            prehash_abort();
+            step_active = false;
+            if (!prehash_params.set(parallelism, tag_length, memory_size_kb, iterations, hash_type)) {
+                return false;
+            }
+
+            const uint32_t header[] = { parallelism, tag_length, memory_size_kb, iterations, version, hash_type };
+            prehash = Blake2b{64};
+            prehash.update(header, sizeof(header));
+            prehash_active = true;
+            return true;
+        }
+
+        [[gnu::unused]]
+        bool prehash_field(uint32_t length) {
+            if (
+                !prehash_active ||
+                prehash_remaining > 0 ||
+                prehash_fields == 4 ||
+                (prehash_fields == 1 && length < 8)  // salt
+            ) {
+                return prehash_abort();
+            }
+
+            prehash.update(&length, sizeof(length));
+            ++prehash_fields;
+            prehash_remaining = length;
+            return true;
+        }
+
+        [[gnu::unused]]
+        bool prehash_update(const void *data, uint32_t length) {
+            if (!prehash_active || prehash_fields == 0 || length > prehash_remaining || (!data && length > 0)) {
+                return prehash_abort();
+            }
+
+            prehash.update(data, length);
+            prehash_remaining -= length;
+            return true;
+        }
+
+        // Like prehash_update(const void*, uint32_t), the bytes are read from the start of buffer().
+        [[gnu::unused]]
+        bool prehash_update(uint32_t length) {
+            return prehash_update(length <= memory.bytes() ? memory.B : nullptr, length);
+        }
+
+        // Writes a key for a cache of tags to the start of buffer(), without finishing the pre-hash. Equal keys give
+        // equal tags. The key is a hash of the pre-hash digest under its own label and a secret of the host of at
+        // most 64 bytes, which is read from the start of buffer(). The pre-hash digest itself never leaves the module.
+        [[gnu::unused]]
+        void *prehash_digest(uint32_t secret_length) {
+            if (
+                !prehash_active ||
+                prehash_fields < 4 ||
+                prehash_remaining > 0 ||
+                secret_length > 64 ||
+                !memory.reserve(1, secret_length)
+            ) {
+                return nullptr;
+            }
+
+            static constexpr char label[] = "passwordhash tag cache key";
+            uint8_t H0[64];
+            Blake2b copy = prehash;
+            copy.finalize(H0, sizeof(H0));
+            copy.wipe();
+            Blake2b::hash(memory.B, 64, {
+                { label, sizeof(label) - 1 },
+                { &secret_length, sizeof(secret_length) },
+                { memory.B, secret_length },
+                { H0, sizeof(H0) },
+            });
+            memset(H0, 0, sizeof(H0));
+            __asm__ __volatile__ ("" : : "r"(H0) : "memory");
+            return memory.B;
+        }
+
+        [[gnu::unused]]
+        bool prehash_finish() {
+            const Params &params = prehash_params;
+            if (
+                !prehash_active ||
+                prehash_fields < 4 ||
+                prehash_remaining > 0 ||
+                !memory.reserve(params.lanes * params.lane_length, 0)
+            ) {
+                return prehash_abort();
+            }
+
+            uint8_t H0[64];
+            prehash.finalize(H0, sizeof(H0));
+            initialize(memory.B, params, H0);
+
+            step_params = params;
+            step_position = {};
+            step_active = true;
+            prehash_abort();
+            return true;
+        }
+
+        // The tag is written to buffer().
+        [[gnu::unused]]
+        bool argon2_hash(
+            uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+            uint32_t hash_type,
+            const void *password, uint32_t password_length,
+            const void *salt, uint32_t salt_length,
+            const void *key, uint32_t key_length,
+            const void *associated_data, uint32_t associated_data_length
+        ) {
+            Params params;
+            if (!prepare(
+                params, parallelism, tag_length, memory_size_kb, iterations, hash_type,
+                password, password_length, salt, salt_length, key, key_length, associated_data, associated_data_length
+            )) {
+                return false;
+            }
+
+            run(memory.B, params);
+            finalize(memory.B, params);
+            return true;
+        }
+
+#ifdef BENCHMARK
+        // Computes a hash of a fixed input, and stores the duration of every pass in pass_seconds.
+        bool timed_hash(const Params &params, double *pass_seconds) {
+            if (!memory.reserve(params.lanes * params.lane_length, 0)) {
+                return false;
+            }
+
+            const uint8_t salt[8] = {};
+            initialize(memory.B, params, {
+                { &params.lanes, sizeof(params.lanes) },
+                { &params.memory_size_kb, sizeof(params.memory_size_kb) },
+                { &params.iterations, sizeof(params.iterations) },
+                { salt, sizeof(salt) },
+            });
+
+            for (Position position = {}; position.pass_r < params.iterations; ++position.pass_r) {
+                const double start = now();
+                for (position.slice_s = 0; position.slice_s < sync_points; ++position.slice_s) {
+                    fill_slice(memory.B, params, position, params.segment_length);
                 }
+                pass_seconds[position.pass_r] = now() - start;
+            }
 
-                uint32_t ref_index = index_alpha(pass_r, slice_s, i, static_cast<uint32_t>(B[prev_offset].u64[0]));
-                Block &curr_block = B[curr_offset];
-                Block &prev_block = B[prev_offset];
-                Block &ref_block = B[ref_index];
-                fill_block(curr_block, prev_block, ref_block, (pass_r > 0));
+            finalize(memory.B, params);
+            return true;
+        }
+#endif
+    };
+
+
+#if !defined(LIBRARY)
+    // The state behind the exports of the WebAssembly module.
+    Argon2 default_context = {};
+#endif
+
+
+#if !defined(__wasm__)
+    // Compares two tags in constant time.
+    bool equal_tags(const void *a_, const void *b_, uint32_t length) {
+        const uint8_t *a = reinterpret_cast<const uint8_t*>(a_);
+        const uint8_t *b = reinterpret_cast<const uint8_t*>(b_);
+        uint8_t difference = 0;
+        for (uint32_t i = 0; i < length; ++i) {
+            difference |= a[i] ^ b[i];
+        }
+        __asm__ __volatile__ ("" : "+r"(difference));
+        return difference == 0;
+    }
+
+
+    // Jobs of a batch are computed by a fixed number of workers, each with a context of its own.
+    // The memory of a context is kept for the next job. A job is only started if its memory and the memory
+    // that all workers keep fit into the budget, otherwise the memory of idle workers is released first.
+    // The jobs are started in the order they were submitted.
+    class Batch {
+    private:
+        struct Worker {
+            Batch *batch;
+            pthread_t thread;
+            Argon2 context;
+
+            // guarded by mutex:
+            uint64_t kept_kb;
+            bool busy;
+        };
+
+        Mutex mutex;
+        Condition work_cond;  // a job was queued, a worker finished, or the batch stops
+        Condition done_cond;
+
+        Worker *workers = nullptr;
+        uint32_t worker_count = 0;
+        uint64_t budget_kb = 0;
+
+        // guarded by mutex:
+        argon2_job *head = nullptr;
+        argon2_job *tail = nullptr;
+        bool stopping = false;
+        argon2_batch_stats stats = {};
+
+        static uint64_t memory_kb(const argon2_job &job) {
+            Params params;
+            if (!params.set(job.parallelism, job.tag_length, job.memory_size_kb, job.iterations, job.hash_type)) {
+                return 0;
             }
+            // Memory maps large areas in whole huge pages.
+            const uint64_t kb = static_cast<uint64_t>(params.lanes) * params.lane_length * (sizeof(Block) / 1024);
+            return kb < 2048 ? kb : (kb + 2047) & ~UINT64_C(2047);
         }
 
-        static void run() {
-            for (uint32_t pass_r = 0; pass_r < iterations; ++pass_r) {
-                for (uint32_t slice_s = 0; slice_s < sync_points; ++slice_s) {
-                    fill_segment(pass_r, slice_s);
+        static bool valid(const argon2_job &job) {
+            return (
+                job.complete &&
+                (job.tag || job.expected_tag) &&
+                (job.password || job.password_length == 0) &&
+                (job.salt && job.salt_length >= 8) &&
+                (job.key || job.key_length == 0) &&
+                (job.associated_data || job.associated_data_length == 0)
+            );
+        }
+
+        // Called with mutex held. Returns true if self can start the first job now.
+        bool admit(Worker &self) {
+            const uint64_t need_kb = memory_kb(*head);
+            auto fits = [&]() -> bool {
+                const uint64_t own_kb = self.kept_kb > need_kb ? self.kept_kb : need_kb;
+                return stats.memory_kb - self.kept_kb + own_kb <= budget_kb;
+            };
+
+            for (uint32_t w = 0; w < worker_count && !fits(); ++w) {
+                Worker &other = workers[w];
+                if (&other != &self && !other.busy && other.kept_kb > 0) {
+                    other.context.release();
+                    stats.memory_kb -= other.kept_kb;
+                    other.kept_kb = 0;
                 }
-#if GENKAT
-#   if 0
-                ::printf("\n After pass %d:\n", pass_r);
-                for (uint32_t block_no = 0; block_no < memory_blocks; ++block_no) {
-                    for (uint32_t int_no = 0; int_no < 128; ++int_no) {
-                        ::printf(
-                            "Block %04d [%3d]: %016llx\n",
-                            (unsigned) block_no,
-                            (unsigned) int_no,
-                            (unsigned long long) B[block_no].u64[int_no]
-                        );
+            }
+            if (!fits()) {
+                return false;
+            }
+
+            if (need_kb > self.kept_kb) {
+                // Released before, so that the old and the new blocks are never mapped at the same time.
+                self.context.release();
+                stats.memory_kb += need_kb - self.kept_kb;
+                self.kept_kb = need_kb;
+                if (stats.memory_kb > stats.max_memory_kb) {
+                    stats.max_memory_kb = stats.memory_kb;
+                }
+            }
+            return true;
+        }
+
+        static int compute(Argon2 &context, const argon2_job &job) {
+            bool success = context.argon2_hash(
+                job.parallelism, job.tag_length, job.memory_size_kb, job.iterations, job.hash_type,
+                job.password, job.password_length,
+                job.salt, job.salt_length,
+                job.key, job.key_length,
+                job.associated_data, job.associated_data_length
+            );
+            if (success && job.expected_tag) {
+                success = equal_tags(context.tag(), job.expected_tag, job.tag_length);
+            } else if (success) {
+                memcpy(job.tag, context.tag(), job.tag_length);
+            }
+            context.wipe();
+            return success;
+        }
+
+        void work(Worker &self) {
+            mutex.lock();
+            while (true) {
+                if (!head || !admit(self)) {
+                    if (stopping && !head) {
+                        break;
                     }
+                    work_cond.wait(mutex);
+                    continue;
                 }
-#   endif
+
+                argon2_job *job = head;
+                head = job->internal_next;
+                if (!head) {
+                    tail = nullptr;
+                }
+                --stats.queued;
+                ++stats.running;
+                self.busy = true;
+                mutex.unlock();
+
+                // The callback might free the job.
+                const double submitted = job->internal_submitted;
+                const double start = now();
+                const int result = compute(self.context, *job);
+                const double end = now();
+                job->complete(job, result);
+
+                mutex.lock();
+                self.busy = false;
+                --stats.running;
+                ++stats.completed;
+                stats.total_wait_seconds += start - submitted;
+                stats.total_run_seconds += end - start;
+                if (end - submitted > stats.max_latency_seconds) {
+                    stats.max_latency_seconds = end - submitted;
+                }
+                done_cond.broadcast();
+                // The memory of this worker can be released for the next job now.
+                work_cond.broadcast();
+            }
+            mutex.unlock();
+        }
+
+        static void *worker_main(void *worker_) {
+            Worker &worker = *reinterpret_cast<Worker*>(worker_);
+            worker.batch->work(worker);
+            return nullptr;
+        }
+
+        void stop() {
+            mutex.lock();
+            stopping = true;
+            work_cond.broadcast();
+            mutex.unlock();
+
+            for (uint32_t w = 0; w < worker_count; ++w) {
+                pthread_join(workers[w].thread, nullptr);
+                workers[w].context.release();
+            }
+            delete[] workers;
+            workers = nullptr;
+            worker_count = 0;
+        }
+
+    public:
+        // Starts worker_count workers (0 = one per CPU). A budget of 0 allows 64 MiB per worker.
+        bool start(uint32_t worker_count_, uint64_t budget_kb_, uint32_t memory_flags) {
+            if (worker_count_ == 0) {
+                const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                worker_count_ = cpus > 0 ? static_cast<uint32_t>(cpus) : 1;
+            }
+            budget_kb = budget_kb_ ? budget_kb_ : static_cast<uint64_t>(worker_count_) * 64 * 1024;
+
+            workers = new (std::nothrow) Worker[worker_count_] {};
+            if (!workers) {
+                return false;
+            }
+            for (; worker_count < worker_count_; ++worker_count) {
+                workers[worker_count].batch = this;
+                workers[worker_count].context.set_memory_flags(memory_flags);
+                if (pthread_create(&workers[worker_count].thread, nullptr, worker_main, &workers[worker_count]) != 0) {
+                    stop();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Returns false if a parameter is out of range, or if the job would never fit into the budget.
+        bool submit(argon2_job &job) {
+            const uint64_t need_kb = memory_kb(job);
+            if (!valid(job) || need_kb == 0 || need_kb > budget_kb) {
+                return false;
+            }
+
+            job.internal_next = nullptr;
+            job.internal_submitted = now();
+
+            mutex.lock();
+            if (tail) {
+                tail->internal_next = &job;
+            } else {
+                head = &job;
+            }
+            tail = &job;
+            ++stats.submitted;
+            if (++stats.queued > stats.max_queued) {
+                stats.max_queued = stats.queued;
+            }
+            work_cond.broadcast();
+            mutex.unlock();
+            return true;
+        }
+
+        void wait() {
+            mutex.lock();
+            while (stats.queued > 0 || stats.running > 0) {
+                done_cond.wait(mutex);
+            }
+            mutex.unlock();
+        }
+
+        argon2_batch_stats get_stats() {
+            mutex.lock();
+            const argon2_batch_stats result = stats;
+            mutex.unlock();
+            return result;
+        }
+
+        // Finishes the queued jobs, stops the workers and releases their memory.
+        void finish() {
+            wait();
+            if (workers) {
+                stop();
+            }
+        }
+    };
+#endif
+
+
+#ifdef BENCHMARK
+    // Measures the selected kernel. All results are written as JSON.
+    struct Benchmark {
+        static constexpr uint32_t repetitions = 3;
+
+        static inline Memory scratch = {};
+        static inline Argon2 context = {};
+
+        // Nanoseconds per compressed block, the blocks stay in the cache.
+        static double fill_block(bool with_xor) {
+            constexpr uint32_t block_count = 1024;
+            constexpr uint32_t rounds = 256;
+            if (!scratch.reserve(block_count, 0)) {
+                return -1;
+            }
+            Block *B = scratch.B;
+
+            for (uint32_t i = 0; i < 2 * 128; ++i) {
+                B[i / 128].u64[i % 128] = i * UINT64_C(0x9E3779B97F4A7C15);
+            }
+
+            double best = 0;
+            for (uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                const double start = now();
+                for (uint32_t round = 0; round < rounds; ++round) {
+                    for (uint32_t index = 2; index < block_count; ++index) {
+                        const Block &prev = B[index - 1];
+                        const Block &ref = B[prev.u64[0] % (index - 1)];
+                        kernel.fill_block(B[index], prev, ref, with_xor, nullptr);
+                    }
+                }
+                const double elapsed = now() - start;
+                if (repetition == 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            return best * 1e9 / (static_cast<double>(rounds) * (block_count - 2));
+        }
+
+        // MB/s of Blake2b over a long message.
+        static double blake2b() {
+            constexpr uint32_t message_blocks = 1024;
+            constexpr uint32_t rounds = 16;
+            if (!scratch.reserve(message_blocks + 1, 0)) {
+                return -1;
+            }
+            Block *B = scratch.B;
+
+            double best = 0;
+            for (uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                const double start = now();
+                for (uint32_t round = 0; round < rounds; ++round) {
+                    Blake2b::hash(B[message_blocks].bytes, 64, { { B, message_blocks * sizeof(Block) } });
+                }
+                const double elapsed = now() - start;
+                if (repetition == 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            return static_cast<double>(rounds) * message_blocks * sizeof(Block) / best * 1e-6;
+        }
+
+        // Nanoseconds per first block of a lane, i.e. H'(1024) of a 72 byte message.
+        static double hash_blocks() {
+            constexpr uint32_t batch = 16;
+            constexpr uint32_t rounds = 4096;
+            if (!scratch.reserve(batch, 0)) {
+                return -1;
+            }
+            Block *B = scratch.B;
+
+            uint8_t messages[batch][72] = {};
+            const uint8_t *in[batch];
+            Block *out[batch];
+            for (uint32_t n = 0; n < batch; ++n) {
+                messages[n][64] = n;
+                in[n] = messages[n];
+                out[n] = &B[n];
+            }
+
+            double best = 0;
+            for (uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                const double start = now();
+                for (uint32_t round = 0; round < rounds; ++round) {
+                    kernel.hash_blocks(out, in, batch, sizeof(messages[0]));
+                }
+                const double elapsed = now() - start;
+                if (repetition == 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            return best * 1e9 / (static_cast<double>(rounds) * batch);
+        }
+
+        // Nanoseconds per block of the later passes of a 1 MiB hash, including the index computation, measured like
+        // pass_block_ns of benchmark.js. The blocks stay in the cache.
+        static double pass_block() {
+            constexpr uint32_t memory_size_kb = 1024;
+            constexpr uint32_t iterations = 4;
+
+            Params params;
+            if (!params.set(1, default_tag_length, memory_size_kb, iterations, default_hash_type)) {
+                return -1;
+            }
+
+            double best = 0;
+            for (uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                double pass_seconds[iterations];
+                if (!context.timed_hash(params, pass_seconds)) {
+                    return -1;
+                }
+                // The first pass does not XOR, and creates the first blocks of the lanes.
+                for (uint32_t pass_r = 1; pass_r < iterations; ++pass_r) {
+                    if (best == 0 || pass_seconds[pass_r] < best) {
+                        best = pass_seconds[pass_r];
+                    }
+                }
+            }
+            return best * 1e9 / memory_size_kb;
+        }
+
+        // End-to-end latency of one hash, and the throughput of every pass.
+        static void latency(uint32_t parallelism, uint32_t memory_size_kb, uint32_t iterations, const char *separator) {
+            constexpr uint32_t max_iterations = 8;
+
+            Params params;
+            if (
+                iterations > max_iterations ||
+                !params.set(parallelism, default_tag_length, memory_size_kb, iterations, default_hash_type)
+            ) {
+                return;
+            }
+
+            double latencies[repetitions];
+            double best_pass_seconds[max_iterations];
+            for (uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                double pass_seconds[max_iterations];
+                const double start = now();
+                if (!context.timed_hash(params, pass_seconds)) {
+                    return;
+                }
+                latencies[repetition] = now() - start;
+
+                for (uint32_t pass_r = 0; pass_r < iterations; ++pass_r) {
+                    if (repetition == 0 || pass_seconds[pass_r] < best_pass_seconds[pass_r]) {
+                        best_pass_seconds[pass_r] = pass_seconds[pass_r];
+                    }
+                }
+            }
+
+            // Insertion sort for the median.
+            for (uint32_t i = 1; i < repetitions; ++i) {
+                for (uint32_t j = i; j > 0 && latencies[j] < latencies[j - 1]; --j) {
+                    double t = latencies[j];
+                    latencies[j] = latencies[j - 1];
+                    latencies[j - 1] = t;
+                }
+            }
+
+            const double bytes = static_cast<double>(params.lanes) * params.lane_length * sizeof(Block);
+            ::printf(
+                "%s\n        { \"type\": \"d\", \"parallelism\": %u, \"memory_size_kb\": %u, \"iterations\": %u, "
+                "\"min_ms\": %.3f, \"median_ms\": %.3f, \"pass_mb_s\": [",
+                separator, (unsigned) parallelism, (unsigned) memory_size_kb, (unsigned) iterations,
+                latencies[0] * 1e3, latencies[repetitions / 2] * 1e3
+            );
+            for (uint32_t pass_r = 0; pass_r < iterations; ++pass_r) {
+                ::printf("%s%.1f", pass_r ? ", " : "", bytes / best_pass_seconds[pass_r] * 1e-6);
+            }
+            ::printf("] }");
+        }
+
+        static void run() {
+            constexpr uint32_t parallelisms[] = { 1, 4 };
+            constexpr uint32_t memory_sizes_kb[] = { 1024, 16 * 1024, 64 * 1024, 256 * 1024 };
+            constexpr uint32_t iteration_counts[] = { 1, 4 };
+
+            Kernel kernels[Kernel::max_count];
+            const uint32_t kernel_count = Kernel::supported(kernels);
+
+            ::printf("{\n  \"build\": \"native\",\n  \"kernels\": [");
+            for (uint32_t k = 0; k < kernel_count; ++k) {
+                kernel = kernels[k];
+                ::printf("%s\n    {\n      \"kernel\": \"%s\",\n", k ? "," : "", kernel.name);
+                ::printf("      \"fill_block_ns\": %.2f,\n", fill_block(false));
+                ::printf("      \"fill_block_xor_ns\": %.2f,\n", fill_block(true));
+                ::printf("      \"pass_block_ns\": %.2f,\n", pass_block());
+                ::printf("      \"blake2b_mb_s\": %.1f,\n", blake2b());
+                ::printf("      \"hash_blocks_ns\": %.2f,\n", hash_blocks());
+                ::printf("      \"runs\": [");
+
+                const char *separator = "";
+                for (uint32_t parallelism : parallelisms) {
+                    for (uint32_t memory_size_kb : memory_sizes_kb) {
+                        for (uint32_t iterations : iteration_counts) {
+                            latency(parallelism, memory_size_kb, iterations, separator);
+                            separator = ",";
+                        }
+                    }
+                }
+                ::printf("\n      ]\n    }");
+            }
+            ::printf("\n  ]\n}\n");
+
+            scratch.wipe();
+            scratch.release();
+            context.wipe();
+            context.release();
+        }
+    };
 #endif
+
+
+#ifdef CHECK
+    // Compares every supported kernel against the RFC 9106 test vectors, and against the portable kernel
+    // on random inputs. Every divergence is printed, and makes the check fail.
+    struct Conformance {
+        struct Input {
+            uint32_t parallelism;
+            uint32_t tag_length;
+            uint32_t memory_size_kb;
+            uint32_t iterations;
+            uint32_t hash_type;
+            uint32_t password_length;
+            uint32_t salt_length;
+            uint32_t key_length;
+            uint32_t ad_length;
+            uint8_t password[300];
+            uint8_t salt[40];
+            uint8_t key[40];
+            uint8_t ad[40];
+        };
+
+        static inline Argon2 context = {};
+        static inline uint32_t failures = 0;
+        static inline uint64_t random_state = 0;
+
+        // splitmix64
+        static uint64_t random() {
+            uint64_t z = (random_state += UINT64_C(0x9E3779B97F4A7C15));
+            z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+            z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+            return z ^ (z >> 31);
+        }
+
+        static uint32_t random(uint32_t low, uint32_t high) {
+            return low + static_cast<uint32_t>(random() % (high - low + 1));
+        }
+
+        static void fill_random(void *out, uint32_t length) {
+            uint8_t *c = reinterpret_cast<uint8_t*>(out);
+            while (length--) {
+                *(c++) = static_cast<uint8_t>(random());
+            }
+        }
+
+        static void fail(const char *what) {
+            ++failures;
+            ::printf("FAIL %s: kernel=%s\n", what, kernel.name);
+        }
+
+        static void fail(const char *what, const Input &input) {
+            ++failures;
+            ::printf(
+                "FAIL %s: kernel=%s type=%u p=%u T=%u m=%u t=%u pwd=%u salt=%u key=%u ad=%u\n",
+                what, kernel.name,
+                (unsigned) input.hash_type, (unsigned) input.parallelism, (unsigned) input.tag_length,
+                (unsigned) input.memory_size_kb, (unsigned) input.iterations,
+                (unsigned) input.password_length, (unsigned) input.salt_length,
+                (unsigned) input.key_length, (unsigned) input.ad_length
+            );
+        }
+
+        // One-shot hash through the pointer API, the tag is copied to tag.
+        static bool hash(const Input &input, uint8_t *tag, Argon2 &context = Conformance::context) {
+            if (!context.argon2_hash(
+                input.parallelism, input.tag_length, input.memory_size_kb, input.iterations, input.hash_type,
+                input.password, input.password_length,
+                input.salt, input.salt_length,
+                input.key, input.key_length,
+                input.ad, input.ad_length
+            )) {
+                return false;
+            }
+            memcpy(tag, context.tag(), input.tag_length);
+            context.wipe();
+            return true;
+        }
+
+        // Stepwise hash of a request in the buffer, with steps of max_blocks blocks.
+        static bool hash_steps(const Input &input, uint32_t max_blocks, uint8_t *tag) {
+            const uint32_t header[] = {
+                input.parallelism, input.tag_length, input.memory_size_kb, input.iterations, version, input.hash_type,
+            };
+            const SrcLen fields[] = {
+                { input.password, input.password_length },
+                { input.salt, input.salt_length },
+                { input.key, input.key_length },
+                { input.ad, input.ad_length },
+            };
+
+            uint32_t length = sizeof(header);
+            for (auto [src, src_len] : fields) {
+                length += sizeof(uint32_t) + src_len;
+            }
+            uint8_t *end = reinterpret_cast<uint8_t*>(context.buffer(length));
+            if (!end) {
+                return false;
+            }
+
+            memcpy(end, header, sizeof(header));
+            end += sizeof(header);
+            for (auto [src, src_len] : fields) {
+                const uint32_t field_length = static_cast<uint32_t>(src_len);
+                memcpy(end, &field_length, sizeof(field_length));
+                end += sizeof(field_length);
+                memcpy(end, src, src_len);
+                end += src_len;
+            }
+
+            if (!context.argon2_start(length)) {
+                return false;
+            }
+            double done;
+            uint32_t pass = 0;
+            bool passes_ordered = true;
+            do {
+                const uint32_t next_pass = context.argon2_step_pass();
+                passes_ordered = passes_ordered && next_pass >= pass && next_pass < input.iterations;
+                pass = next_pass;
+                done = context.argon2_step(max_blocks);
+            } while (done >= 0 && done < 1);
+            passes_ordered = passes_ordered && context.argon2_step_pass() == input.iterations;
+
+            memcpy(tag, context.tag(), input.tag_length);
+            context.wipe();
+            return done == 1 && passes_ordered;
+        }
+
+        // Hash with inputs that are fed in chunks of chunk_length bytes through the buffer, then computed stepwise.
+        static bool hash_prehash(const Input &input, uint32_t chunk_length, uint8_t *tag) {
+            const SrcLen fields[] = {
+                { input.password, input.password_length },
+                { input.salt, input.salt_length },
+                { input.key, input.key_length },
+                { input.ad, input.ad_length },
+            };
+
+            if (!context.prehash_start(
+                input.parallelism, input.tag_length, input.memory_size_kb, input.iterations, input.hash_type
+            )) {
+                return false;
+            }
+            for (auto [src, src_len] : fields) {
+                if (!context.prehash_field(static_cast<uint32_t>(src_len))) {
+                    return false;
+                }
+                for (size_t pos = 0; pos < src_len; pos += chunk_length) {
+                    const uint32_t length = min32(chunk_length, static_cast<uint32_t>(src_len - pos));
+                    void *chunk = context.buffer(length);
+                    if (!chunk) {
+                        return false;
+                    }
+                    memcpy(chunk, reinterpret_cast<const uint8_t*>(src) + pos, length);
+                    if (!context.prehash_update(length)) {
+                        return false;
+                    }
+                }
+            }
+
+            // The cache keys depend on the secret, and reading them leaves the pre-hash as it was.
+            uint8_t keys[3][64];
+            for (uint32_t k = 0; k < 3; ++k) {
+                uint8_t *secret = reinterpret_cast<uint8_t*>(context.buffer(32));
+                if (!secret) {
+                    return false;
+                }
+                memset(secret, 0, 32);
+                secret[0] = k == 2;
+                const void *key = context.prehash_digest(32);
+                if (!key) {
+                    return false;
+                }
+                memcpy(keys[k], key, sizeof(keys[k]));
+            }
+            if (
+                __builtin_memcmp(keys[0], keys[1], sizeof(keys[0])) != 0 ||
+                __builtin_memcmp(keys[0], keys[2], sizeof(keys[0])) == 0
+            ) {
+                return false;
+            }
+
+            if (!context.prehash_finish()) {
+                return false;
+            }
+
+            double done;
+            do {
+                done = context.argon2_step(0);
+            } while (done >= 0 && done < 1);
+
+            memcpy(tag, context.tag(), input.tag_length);
+            context.wipe();
+            return done == 1;
+        }
+
+        static void expect(const char *what, const Input &input, const uint8_t *expected) {
+            uint8_t tag[max_tag_length];
+            if (!hash(input, tag) || __builtin_memcmp(tag, expected, input.tag_length) != 0) {
+                fail(what, input);
+            }
+        }
+
+        static void test_vectors() {
+            // RFC 9106, chapter 5
+            Input rfc = {};
+            rfc.parallelism = 4;
+            rfc.tag_length = 32;
+            rfc.memory_size_kb = 32;
+            rfc.iterations = 3;
+            rfc.password_length = 32;
+            rfc.salt_length = 16;
+            rfc.key_length = 8;
+            rfc.ad_length = 12;
+            memset(rfc.password, 0x01, rfc.password_length);
+            memset(rfc.salt, 0x02, rfc.salt_length);
+            memset(rfc.key, 0x03, rfc.key_length);
+            memset(rfc.ad, 0x04, rfc.ad_length);
+
+            static constexpr uint8_t expected_d[32] = {
+                0x51, 0x2b, 0x39, 0x1b, 0x6f, 0x11, 0x62, 0x97, 0x53, 0x71, 0xd3, 0x09, 0x19, 0x73, 0x42, 0x94,
+                0xf8, 0x68, 0xe3, 0xbe, 0x39, 0x84, 0xf3, 0xc1, 0xa1, 0x3a, 0x4d, 0xb9, 0xfa, 0xbe, 0x4a, 0xcb,
+            };
+            static constexpr uint8_t expected_i[32] = {
+                0xc8, 0x14, 0xd9, 0xd1, 0xdc, 0x7f, 0x37, 0xaa, 0x13, 0xf0, 0xd7, 0x7f, 0x24, 0x94, 0xbd, 0xa1,
+                0xc8, 0xde, 0x6b, 0x01, 0x6d, 0xd3, 0x88, 0xd2, 0x99, 0x52, 0xa4, 0xc4, 0x67, 0x2b, 0x6c, 0xe8,
+            };
+            static constexpr uint8_t expected_id[32] = {
+                0x0d, 0x64, 0x0d, 0xf5, 0x8d, 0x78, 0x76, 0x6c, 0x08, 0xc0, 0x37, 0xa3, 0x4a, 0x8b, 0x53, 0xc9,
+                0xd0, 0x1e, 0xf0, 0x45, 0x2d, 0x75, 0xb6, 0x5e, 0xb5, 0x25, 0x20, 0xe9, 0x6b, 0x01, 0xe6, 0x59,
+            };
+
+            rfc.hash_type = static_cast<uint32_t>(Argon2_type::d);
+            expect("RFC 9106 Argon2d", rfc, expected_d);
+            rfc.hash_type = static_cast<uint32_t>(Argon2_type::i);
+            expect("RFC 9106 Argon2i", rfc, expected_i);
+            rfc.hash_type = static_cast<uint32_t>(Argon2_type::id);
+            expect("RFC 9106 Argon2id", rfc, expected_id);
+
+            // The default parameters use the specialized loop.
+            Input defaults = {};
+            defaults.parallelism = default_parallelism;
+            defaults.tag_length = default_tag_length;
+            defaults.memory_size_kb = default_memory_size_kb;
+            defaults.iterations = default_iterations;
+            defaults.hash_type = static_cast<uint32_t>(default_hash_type);
+            defaults.password_length = 8;
+            defaults.salt_length = 8;
+            memcpy(defaults.password, "test1234", 8);
+            memcpy(defaults.salt, "salt1234", 8);
+
+            static constexpr uint8_t expected_defaults[32] = {
+                0x8a, 0xeb, 0x83, 0xcf, 0x9f, 0x9c, 0x45, 0x0f, 0xde, 0xe9, 0xfd, 0x1f, 0x59, 0x22, 0x86, 0x5e,
+                0x76, 0xcb, 0x1a, 0x24, 0x29, 0x69, 0xd8, 0x5a, 0xf6, 0x99, 0x85, 0x33, 0x1d, 0xfa, 0x1f, 0x27,
+            };
+            expect("default parameters", defaults, expected_defaults);
+        }
+
+        // Every thread hashes with a context of its own, while the other threads do the same.
+        static constexpr uint32_t thread_count = 4;
+        static constexpr uint32_t cases_per_thread = 8;
+
+        struct Thread_case {
+            Input input;
+            uint8_t expected[max_tag_length];
+            bool success;
+        };
+
+        static inline Thread_case thread_cases[thread_count][cases_per_thread];
+
+        static void *thread_main(void *cases_) {
+            Thread_case (&cases)[cases_per_thread] = *reinterpret_cast<Thread_case (*)[cases_per_thread]>(cases_);
+
+            Argon2 own_context = {};
+            for (Thread_case &c : cases) {
+                uint8_t actual[max_tag_length];
+                c.success = (
+                    hash(c.input, actual, own_context) &&
+                    __builtin_memcmp(actual, c.expected, c.input.tag_length) == 0
+                );
             }
+            own_context.release();
+            return nullptr;
         }
 
-        static void finalize() {
-            hash(&B, tag_length, B[memory_blocks - 1].bytes, sizeof(Block));
+        // Every fixed shape with its own loop and with the generic loop.
+        template <class... Shapes>
+        static void fixed_shapes(Shape_list<Shapes...>) {
+            (fixed_shape<Shapes>(), ...);
         }
 
-    public:
-        [[gnu::unused]]
-        static bool argon2_hash(uint32_t buffer_length) {
-            const uint32_t min_buffer_length = (
-                sizeof(uint32_t) +  // parallelism
-                sizeof(uint32_t) +  // tag_length
-                sizeof(uint32_t) +  // memory_size_kb
-                sizeof(uint32_t) +  // iterations
-                sizeof(uint32_t) +  // version
-                sizeof(uint32_t) +  // hash_type
-                sizeof(uint32_t) +  // hash_type
-                0                +  // password
-                sizeof(uint32_t) +  // salt_length
-                8                +  // salt
-                sizeof(uint32_t) +  // key_length
-                0                +  // key
-                sizeof(uint32_t) +  // associated_data_length
-                0                   // associated_data
-            );
-            if (buffer_length < min_buffer_length) {
-                return false;
+        template <class Shape>
+        static void fixed_shape() {
+            Input input = random_input();
+            input.parallelism = Shape::lanes;
+            input.memory_size_kb = Shape::lanes * Shape::lane_length;
+            input.iterations = Shape::iterations;
+
+            uint8_t expected[max_tag_length];
+            uint8_t actual[max_tag_length];
+            Argon2::generic_only = true;
+            const bool success = hash(input, expected);
+            Argon2::generic_only = false;
+            if (
+                !success || !hash(input, actual) ||
+                __builtin_memcmp(actual, expected, input.tag_length) != 0
+            ) {
+                fail("fixed shape", input);
             }
+        }
 
-            const uint8_t *buffer = reinterpret_cast<const uint8_t*>(&B);
-            uint32_t buffer_pos = 0;
+        static void concurrent_contexts() {
+            for (auto &cases : thread_cases) {
+                for (Thread_case &c : cases) {
+                    c.input = random_input();
+                    c.success = hash(c.input, c.expected);
+                }
+            }
 
-            auto buffer_incrementable = [&](uint32_t count) -> bool {
-                return (
-                    (buffer_pos + count >= buffer_pos) &&
-                    (buffer_pos + count >= count) &&
-                    (buffer_pos + count <= buffer_length)
-                );
-            };
+            pthread_t threads[thread_count];
+            uint32_t started = 0;
+            for (; started < thread_count; ++started) {
+                if (pthread_create(&threads[started], nullptr, thread_main, &thread_cases[started]) != 0) {
+                    break;
+                }
+            }
+            for (uint32_t t = 0; t < started; ++t) {
+                pthread_join(threads[t], nullptr);
+            }
 
-            auto buffer_increment = [&](uint32_t count) -> bool {
-                if (!buffer_incrementable(count)) {
-                    return false;
+            for (auto &cases : thread_cases) {
+                for (Thread_case &c : cases) {
+                    if (!c.success) {
+                        fail("concurrent contexts", c.input);
+                    }
                 }
+            }
+        }
 
-                buffer_pos += count;
-                return true;
-            };
+        // Jobs of a batch whose budget is smaller than the memory of all workers together.
+        struct Batch_case {
+            argon2_job job;
+            Input input;
+            uint8_t expected[max_tag_length];
+            uint8_t actual[max_tag_length];
+            int result;
+        };
 
-            auto buffer_read_u32 = [&](uint32_t &out) -> bool {
-                if (!buffer_incrementable(sizeof(uint32_t))) {
-                    return false;
+        static void batch_jobs() {
+            constexpr uint32_t job_count = 24;
+            const argon2_batch_config config = { 3, 4096, ARGON2_MEMORY_PREFAULT };
+
+            static Batch_case cases[job_count];
+            for (uint32_t n = 0; n < job_count; ++n) {
+                Batch_case &c = cases[n];
+                c.input = random_input();
+                if (!hash(c.input, c.expected)) {
+                    fail("rejected", c.input);
+                }
+                memset(c.actual, 0, sizeof(c.actual));
+                // Every third job verifies, and every sixth of them with a wrong tag.
+                if (n % 3 == 2) {
+                    memcpy(c.actual, c.expected, c.input.tag_length);
+                    c.actual[0] ^= n % 6 == 5;
                 }
 
-                memcpy(&out, buffer + buffer_pos, sizeof(uint32_t));
-                buffer_pos += sizeof(sizeof(uint32_t));
-                return true;
-            };
+                c.result = -1;
+                c.job = {};
+                c.job.parallelism = c.input.parallelism;
+                c.job.tag_length = c.input.tag_length;
+                c.job.memory_size_kb = c.input.memory_size_kb;
+                c.job.iterations = c.input.iterations;
+                c.job.hash_type = c.input.hash_type;
+                c.job.password = c.input.password;
+                c.job.password_length = c.input.password_length;
+                c.job.salt = c.input.salt;
+                c.job.salt_length = c.input.salt_length;
+                c.job.key = c.input.key;
+                c.job.key_length = c.input.key_length;
+                c.job.associated_data = c.input.ad;
+                c.job.associated_data_length = c.input.ad_length;
+                c.job.tag = n % 3 == 2 ? nullptr : c.actual;
+                c.job.expected_tag = n % 3 == 2 ? c.actual : nullptr;
+                c.job.complete = [](argon2_job *job, int result) {
+                    reinterpret_cast<Batch_case*>(job->user_data)->result = result;
+                };
+                c.job.user_data = &c;
+            }
 
-            auto buffer_read_u32_exact = [&](uint32_t expected) -> bool {
-                uint32_t actual;
-                return buffer_read_u32(actual) && expected == actual;
-            };
+            argon2_batch *batch = argon2_batch_new(&config);
+            if (!batch) {
+                fail("batch");
+                return;
+            }
 
-            auto buffer_read_str = [&](uint32_t min_length) -> bool {
-                uint32_t count;
-                return buffer_read_u32(count) && (count >= min_length) && buffer_increment(count);
-            };
+            argon2_job too_large = cases[0].job;
+            too_large.memory_size_kb = 2 * config.memory_budget_kb;
+            if (argon2_batch_submit(batch, &too_large)) {
+                fail("batch admitted a job larger than the budget");
+            }
 
+            for (Batch_case &c : cases) {
+                if (!argon2_batch_submit(batch, &c.job)) {
+                    fail("batch rejected", c.input);
+                }
+            }
+            argon2_batch_wait(batch);
+
+            argon2_batch_stats stats;
+            argon2_batch_stats_get(batch, &stats);
+            argon2_batch_free(batch);
+
+            for (uint32_t n = 0; n < job_count; ++n) {
+                const Batch_case &c = cases[n];
+                const bool success = n % 3 != 2 ? (
+                    c.result == 1 && __builtin_memcmp(c.actual, c.expected, c.input.tag_length) == 0
+                ) : (
+                    c.result == (n % 6 == 5 ? 0 : 1)
+                );
+                if (!success) {
+                    fail("batch", c.input);
+                }
+            }
             if (
-                !buffer_read_u32_exact(parallelism) ||
-                !buffer_read_u32_exact(tag_length) ||
-                !buffer_read_u32_exact(memory_size_kb) ||
-                !buffer_read_u32_exact(iterations) ||
-                !buffer_read_u32_exact(version) ||
-                !buffer_read_u32_exact(hash_type) ||
-                !buffer_read_str(0) ||  // password
-                !buffer_read_str(8) ||  // salt
-                !buffer_read_str(0) ||  // key
-                !buffer_read_str(0) ||  // associated_data
-                !(buffer_pos == buffer_length) ||
-                false
+                stats.submitted != job_count || stats.completed != job_count ||
+                stats.queued != 0 || stats.running != 0 ||
+                stats.max_memory_kb > config.memory_budget_kb
             ) {
-                return false;
+                fail("batch stats");
             }
+        }
 
-            initialize({
-                { buffer, buffer_length },
-            });
-            run();
-            finalize();
+        static Input random_input() {
+            // Lengths around the Blake2b block size are the interesting ones.
+            constexpr uint32_t password_lengths[] = { 0, 1, 64, 127, 128, 129, 256, 300 };
+
+            Input input = {};
+            input.parallelism = random(1, 6);
+            input.tag_length = random(0, 3) ? random(min_tag_length, 64) : random(65, 300);
+            input.memory_size_kb = random(2 * sync_points * input.parallelism, 2048);
+            input.iterations = random(1, 3);
+            input.hash_type = random(0, 2);
+            input.password_length = random(0, 1) ? password_lengths[random(0, 7)] : random(0, 300);
+            input.salt_length = random(8, 40);
+            input.key_length = random(0, 40);
+            input.ad_length = random(0, 40);
+            fill_random(input.password, input.password_length);
+            fill_random(input.salt, input.salt_length);
+            fill_random(input.key, input.key_length);
+            fill_random(input.ad, input.ad_length);
+            return input;
+        }
 
-            return true;
+        // The building blocks of the kernel against the portable kernel.
+        static void compare_primitives(const Kernel &reference) {
+            for (uint32_t round = 0; round < 64; ++round) {
+                alignas(64) static Block X, Y, N, M;
+                fill_random(&X, sizeof(X));
+                fill_random(&Y, sizeof(Y));
+                fill_random(&N, sizeof(N));
+                memcpy(&M, &N, sizeof(N));
+                const bool with_xor = random(0, 1);
+                // The early word is the first word of the new block.
+                uint64_t early_word = ~M.u64[0];
+                const Early_word early = {
+                    [](const void *context, uint64_t word) {
+                        *reinterpret_cast<uint64_t*>(const_cast<void*>(context)) = word;
+                    },
+                    &early_word,
+                };
+                reference.fill_block(N, X, Y, with_xor, nullptr);
+                kernel.fill_block(M, X, Y, with_xor, &early);
+                if (__builtin_memcmp(&N, &M, sizeof(N)) != 0) {
+                    fail("fill_block");
+                }
+                if (early_word != M.u64[0]) {
+                    fail("fill_block early word");
+                }
+
+                uint64_t h[8], g[8], m[16];
+                fill_random(h, sizeof(h));
+                fill_random(m, sizeof(m));
+                memcpy(g, h, sizeof(h));
+                const uint64_t t = random();
+                const bool is_last_block = random(0, 1);
+                reference.blake2b_compress(h, m, t, is_last_block);
+                kernel.blake2b_compress(g, m, t, is_last_block);
+                if (__builtin_memcmp(h, g, sizeof(h)) != 0) {
+                    fail("blake2b_compress");
+                }
+
+                constexpr uint32_t max_count = 19;
+                static uint8_t messages[max_count][300];
+                static Block expected[max_count], actual[max_count];
+                const uint8_t *in[max_count];
+                Block *out_expected[max_count], *out_actual[max_count];
+                const uint32_t count = random(1, max_count);
+                const uint32_t in_length = random(1, 300);
+                for (uint32_t n = 0; n < count; ++n) {
+                    fill_random(messages[n], in_length);
+                    in[n] = messages[n];
+                    out_expected[n] = &expected[n];
+                    out_actual[n] = &actual[n];
+                }
+                reference.hash_blocks(out_expected, in, count, in_length);
+                kernel.hash_blocks(out_actual, in, count, in_length);
+                if (__builtin_memcmp(expected, actual, count * sizeof(Block)) != 0) {
+                    fail("hash_blocks");
+                }
+            }
         }
 
-        [[gnu::unused]]
-        static bool argon2_hash(
-            const void *password, uint32_t password_length,
-            const void *salt, uint32_t salt_length,
-            const void *key, uint32_t key_length,
-            const void *associated_data, uint32_t associated_data_length
-        ) {
-            if (
-                (!password && password_length > 0) ||
-                (!salt || salt_length < 8) ||
-                (!key && key_length > 0) ||
-                (!associated_data && associated_data_length > 0)
-            ) {
-                return false;
+        static int run(uint64_t seed, uint32_t cases) {
+            Kernel kernels[Kernel::max_count];
+            const uint32_t kernel_count = Kernel::supported(kernels);
+            const Kernel reference = Kernel::of<Kernel_ref>();
+
+            for (uint32_t k = 0; k < kernel_count; ++k) {
+                kernel = kernels[k];
+                ::printf("Kernel %s\n", kernel.name);
+                test_vectors();
+                compare_primitives(reference);
             }
 
-            initialize({
-                { &parallelism, sizeof(parallelism) },
-                { &tag_length, sizeof(tag_length) },
-                { &memory_size_kb, sizeof(memory_size_kb) },
-                { &iterations, sizeof(iterations) },
-                { &version, sizeof(version) },
-                { &hash_type, sizeof(hash_type) },
+            ::printf("Random cases, seed %llu\n", (unsigned long long) seed);
+            random_state = seed;
+            for (uint32_t c = 0; c < cases; ++c) {
+                const Input input = random_input();
 
-                { &password_length, sizeof(password_length) },
-                { password, password_length },
+                uint8_t expected[max_tag_length];
+                kernel = reference;
+                if (!hash(input, expected)) {
+                    fail("rejected", input);
+                    continue;
+                }
 
-                { &salt_length, sizeof(salt_length) },
-                { salt, salt_length },
+                for (uint32_t k = 0; k < kernel_count; ++k) {
+                    kernel = kernels[k];
+                    uint8_t actual[max_tag_length];
+                    if (!hash(input, actual) || __builtin_memcmp(actual, expected, input.tag_length) != 0) {
+                        fail("one-shot", input);
+                    }
+                    if (
+                        !hash_steps(input, random(0, 300), actual) ||
+                        __builtin_memcmp(actual, expected, input.tag_length) != 0
+                    ) {
+                        fail("steps", input);
+                    }
+                    if (
+                        !hash_prehash(input, random(1, 200), actual) ||
+                        __builtin_memcmp(actual, expected, input.tag_length) != 0
+                    ) {
+                        fail("pre-hash in chunks", input);
+                    }
+                }
+            }
 
-                { &key_length, sizeof(key_length) },
-                { key, key_length },
+            kernel = kernels[0];
+            fixed_shapes(Fixed_shapes{});
+            concurrent_contexts();
+            batch_jobs();
 
-                { &associated_data_length, sizeof(associated_data_length) },
-                { associated_data, associated_data_length },
-            });
-            run();
-            finalize();
+            context.wipe();
+            context.release();
 
-            return true;
+            if (failures) {
+                ::printf("%u FAILURES\n", (unsigned) failures);
+                return 1;
+            }
+            ::printf("All %u kernels agree\n", (unsigned) kernel_count);
+            return 0;
         }
     };
+#endif
 
 }  // anonymous inline namespace
 
 
 extern "C" {
 
+#if !defined(LIBRARY)
+    // Returns where the host has to put a request of buffer_length bytes, or null if there is not enough memory.
+    __attribute__((visibility("default")))
+    void *argon2_buffer(uint32_t buffer_length) {
+        return default_context.buffer(buffer_length);
+    }
+
     __attribute__((visibility("default")))
     bool argon2(uint32_t buffer_length) {
-        return Argon2::argon2_hash(buffer_length);
+        return default_context.argon2_hash(buffer_length);
+    }
+
+    // Clears everything the last requests left in the memory. The host has to copy the tag first.
+    __attribute__((visibility("default")))
+    void argon2_wipe() {
+        default_context.wipe();
+    }
+
+    __attribute__((visibility("default")))
+    bool argon2_start(uint32_t buffer_length) {
+        return default_context.argon2_start(buffer_length);
+    }
+
+    __attribute__((visibility("default")))
+    double argon2_step(uint32_t max_blocks) {
+        return default_context.argon2_step(max_blocks);
+    }
+
+    // The pass that the next argon2_step() computes, for the timings of the worker.
+    __attribute__((visibility("default")))
+    uint32_t argon2_step_pass() {
+        return default_context.argon2_step_pass();
+    }
+
+    // Starts a hash whose inputs are fed in pieces. Every input (password, salt, key, associated data) is
+    // announced by argon2_prehash_field(), and its bytes are passed by argon2_prehash_update() in chunks,
+    // at argon2_buffer(chunk_length). After argon2_prehash_finish() the hash is computed by argon2_step().
+    __attribute__((visibility("default")))
+    bool argon2_prehash_start(
+        uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+        uint32_t hash_type
+    ) {
+        return default_context.prehash_start(parallelism, tag_length, memory_size_kb, iterations, hash_type);
+    }
+
+    __attribute__((visibility("default")))
+    bool argon2_prehash_field(uint32_t length) {
+        return default_context.prehash_field(length);
+    }
+
+    __attribute__((visibility("default")))
+    bool argon2_prehash_update(uint32_t chunk_length) {
+        return default_context.prehash_update(chunk_length);
+    }
+
+    // Returns where the key of the inputs for a cache of tags was written (64 bytes), or null if not all inputs were
+    // fed. The secret of the cache is read from the start of argon2_buffer(secret_length).
+    __attribute__((visibility("default")))
+    void *argon2_prehash_digest(uint32_t secret_length) {
+        return default_context.prehash_digest(secret_length);
+    }
+
+    __attribute__((visibility("default")))
+    bool argon2_prehash_finish() {
+        return default_context.prehash_finish();
+    }
+#endif
+
+#if defined(ARGON2_THREADS) && defined(__wasm__)
+    // Entry point of the worker instances. Never returns.
+    __attribute__((visibility("default")))
+    void argon2_thread() {
+        Thread_pool::worker_main();
+    }
+#endif
+
+}  // extern "C"
+
+
+#if !defined(__wasm__)
+// The native C API, see passwordhash.h. Every context owns its blocks, so different contexts can be used
+// by different threads at the same time.
+struct argon2_ctx {
+    Argon2 context;
+};
+
+struct argon2_batch {
+    Batch batch;
+};
+
+extern "C" {
+
+    __attribute__((visibility("default")))
+    argon2_ctx *argon2_ctx_new(void) {
+        return new (std::nothrow) argon2_ctx {};
+    }
+
+    __attribute__((visibility("default")))
+    void argon2_ctx_free(argon2_ctx *ctx) {
+        if (ctx) {
+            ctx->context.wipe();
+            ctx->context.release();
+            delete ctx;
+        }
+    }
+
+    __attribute__((visibility("default")))
+    void argon2_ctx_set_memory_flags(argon2_ctx *ctx, uint32_t flags) {
+        if (ctx) {
+            ctx->context.set_memory_flags(flags);
+        }
+    }
+
+    __attribute__((visibility("default")))
+    void argon2_ctx_release(argon2_ctx *ctx) {
+        if (ctx) {
+            ctx->context.wipe();
+            ctx->context.release();
+        }
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_ctx_hash(
+        argon2_ctx *ctx,
+        uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+        uint32_t hash_type,
+        const void *password, uint32_t password_length,
+        const void *salt, uint32_t salt_length,
+        const void *key, uint32_t key_length,
+        const void *associated_data, uint32_t associated_data_length,
+        void *tag
+    ) {
+        const bool success = ctx && tag && ctx->context.argon2_hash(
+            parallelism, tag_length, memory_size_kb, iterations, hash_type,
+            password, password_length,
+            salt, salt_length,
+            key, key_length,
+            associated_data, associated_data_length
+        );
+        if (success) {
+            memcpy(tag, ctx->context.tag(), tag_length);
+        }
+        if (ctx) {
+            ctx->context.wipe();
+        }
+        return success;
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_ctx_verify(
+        argon2_ctx *ctx,
+        uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+        uint32_t hash_type,
+        const void *password, uint32_t password_length,
+        const void *salt, uint32_t salt_length,
+        const void *key, uint32_t key_length,
+        const void *associated_data, uint32_t associated_data_length,
+        const void *expected_tag
+    ) {
+        uint8_t tag[max_tag_length];
+        if (!expected_tag || !argon2_ctx_hash(
+            ctx,
+            parallelism, tag_length, memory_size_kb, iterations, hash_type,
+            password, password_length,
+            salt, salt_length,
+            key, key_length,
+            associated_data, associated_data_length,
+            tag
+        )) {
+            return 0;
+        }
+
+        const bool equal = equal_tags(tag, expected_tag, tag_length);
+
+        memset(tag, 0, sizeof(tag));
+        __asm__ __volatile__ ("" : : "r"(tag) : "memory");
+        return equal;
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_ctx_prehash_start(
+        argon2_ctx *ctx,
+        uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+        uint32_t hash_type
+    ) {
+        return ctx && ctx->context.prehash_start(parallelism, tag_length, memory_size_kb, iterations, hash_type);
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_ctx_prehash_field(argon2_ctx *ctx, uint32_t length) {
+        return ctx && ctx->context.prehash_field(length);
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_ctx_prehash_update(argon2_ctx *ctx, const void *data, uint32_t length) {
+        return ctx && ctx->context.prehash_update(data, length);
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_ctx_prehash_finish(argon2_ctx *ctx, void *tag) {
+        if (!ctx) {
+            return 0;
+        }
+
+        bool success = tag && ctx->context.prehash_finish();
+        if (success) {
+            double done;
+            do {
+                done = ctx->context.argon2_step(0);
+            } while (done >= 0 && done < 1);
+            success = done == 1;
+        }
+        if (success) {
+            memcpy(tag, ctx->context.tag(), ctx->context.step_tag_length());
+        }
+        ctx->context.wipe();
+        return success;
+    }
+
+    __attribute__((visibility("default")))
+    argon2_batch *argon2_batch_new(const argon2_batch_config *config) {
+        argon2_batch *batch = new (std::nothrow) argon2_batch {};
+        const argon2_batch_config defaults = {};
+        if (!config) {
+            config = &defaults;
+        }
+
+        if (batch && !batch->batch.start(config->workers, config->memory_budget_kb, config->memory_flags)) {
+            delete batch;
+            batch = nullptr;
+        }
+        return batch;
+    }
+
+    __attribute__((visibility("default")))
+    int argon2_batch_submit(argon2_batch *batch, argon2_job *job) {
+        return batch && job && batch->batch.submit(*job);
+    }
+
+    __attribute__((visibility("default")))
+    void argon2_batch_wait(argon2_batch *batch) {
+        if (batch) {
+            batch->batch.wait();
+        }
+    }
+
+    __attribute__((visibility("default")))
+    void argon2_batch_stats_get(argon2_batch *batch, argon2_batch_stats *stats) {
+        if (batch && stats) {
+            *stats = batch->batch.get_stats();
+        }
+    }
+
+    __attribute__((visibility("default")))
+    void argon2_batch_free(argon2_batch *batch) {
+        if (batch) {
+            batch->batch.finish();
+            delete batch;
+        }
     }
 
 }  // extern "C"
+#endif
 
 
 
@@ -756,26 +3907,52 @@ int main(void) {
     memset(secret, 3, TEST_SECRETLEN);
     memset(ad, 4, TEST_ADLEN);
 
-    Argon2::argon2_hash(
+    default_context.argon2_hash(
+        4, default_tag_length, default_memory_size_kb, default_iterations, default_hash_type,
         pwd, sizeof(pwd),
         salt, sizeof(salt),
         secret, sizeof(secret),
         ad, sizeof(ad)
     );
-    print_hex("Tag", &B, tag_length);
+    print_hex("Tag", default_context.tag(), default_tag_length);
 #else
     unsigned char pwd[] = "test1234";
     unsigned char salt[] = "salt1234";
 
-    Argon2::argon2_hash(
+    default_context.argon2_hash(
+        default_parallelism, default_tag_length, default_memory_size_kb, default_iterations, default_hash_type,
         pwd, 8,
         salt, 8,
         nullptr, 0,
         nullptr, 0
     );
-    print_hex("Tag", &B, tag_length);
+    print_hex("Tag", default_context.tag(), default_tag_length);
+#endif
+    ::printf("Kernel: %s\n", Argon2::kernel_name());
+
+    default_context.wipe();
+    default_context.release();
+
+    return 0;
+}
 #endif
 
+
+#ifdef BENCHMARK
+int main(void) {
+    Benchmark::run();
     return 0;
 }
 #endif
+
+
+#ifdef CHECK
+extern "C" unsigned long long strtoull(const char *str, char **end, int base);
+
+// Usage: passwordhash.check [seed [cases]]
+int main(int argc, char **argv) {
+    const uint64_t seed = argc > 1 ? ::strtoull(argv[1], nullptr, 0) : 0x13;
+    const uint32_t cases = argc > 2 ? static_cast<uint32_t>(::strtoull(argv[2], nullptr, 0)) : 100;
+    return Conformance::run(seed, cases);
+}
+#endif
@@ -0,0 +1,219 @@
+// Benchmark of the WebAssembly modules in Node.js, the results are written as JSON:
+//
+//     node src/benchmark.js built/passwordhash.wasm built/passwordhash.simd.wasm > bench.wasm.json
+//
+// The threaded module imports a shared memory, whose initial and maximum size in bytes are passed as they were linked.
+// It is measured once on its own, and once with helper threads for the lanes:
+//
+//     node src/benchmark.js built/passwordhash.threads.wasm --memory=2097152,1075838976 > bench.wasm.json
+
+const { readFileSync } = require('fs');
+const { cpus } = require('os');
+const { basename } = require('path');
+const { performance } = require('perf_hooks');
+const { instantiate_shared, start_thread, request } = require('./wasm_host.js');
+
+const {
+    WebAssembly, console, process, JSON, Math, Uint8Array, Error,
+} = new Function('return this')();
+
+const default_tag_length = 32;
+
+const repetitions = 3;
+const parallelisms = [1, 4];
+const memory_sizes_kb = [1024, 16 * 1024, 64 * 1024, 256 * 1024];
+const iteration_counts = [1, 4];
+
+// Length of the password in the Blake2b measurement.
+const blake2b_message_length = 16 * 1024 * 1024;
+
+
+run(process.argv.slice(2)).catch(ex => {
+    console.error(ex);
+    process.exitCode = 1;
+});
+
+
+async function run (args) {
+    const paths = args.filter(arg => arg.endsWith('.wasm'));
+    const memory_limits = args.find(arg => arg.startsWith('--memory='))?.slice(9).split(',').map(Number);
+
+    const kernels = [];
+    for (const path of paths) {
+        const module = new WebAssembly.Module(readFileSync(path));
+        if (!WebAssembly.Module.imports(module).length) {
+            const { exports } = new WebAssembly.Instance(module);
+            kernels.push(measure(basename(path), exports));
+            continue;
+        }
+
+        if (!memory_limits) {
+            throw new Error(`${path} imports its memory, pass --memory=initial,maximum`);
+        }
+        kernels.push(measure(basename(path), instantiate_shared(module, memory_limits).exports));
+
+        // One helper less than the most lanes, and than the CPUs.
+        const thread_count = Math.min(Math.max(...parallelisms), cpus().length) - 1;
+        if (thread_count > 0) {
+            const { exports, memory } = instantiate_shared(module, memory_limits);
+            const threads = [];
+            for (let index = 0; index < thread_count; ++index) {
+                threads.push(await start_thread(module, memory, index));
+            }
+            kernels.push(measure(`${basename(path)} + ${thread_count} threads`, exports));
+            for (const thread of threads) {
+                thread.terminate();
+            }
+        }
+    }
+
+    const result = { build: 'wasm', node: process.version, kernels };
+    process.stdout.write(JSON.stringify(result, null, 2) + '\n');
+}
+
+
+function measure (kernel, exports) {
+    const runs = [];
+    for (const parallelism of parallelisms) {
+        for (const memory_size_kb of memory_sizes_kb) {
+            for (const iterations of iteration_counts) {
+                runs.push(latency(exports, { parallelism, memory_size_kb, iterations }));
+            }
+        }
+    }
+
+    return {
+        kernel,
+        pass_block_ns: pass_block(exports),
+        blake2b_mb_s: blake2b(exports),
+        hash_blocks_ns: hash_blocks(exports),
+        runs,
+    };
+}
+
+
+// Computes one hash. Returns the duration of the whole request, of the pre-hash and of every pass in seconds.
+function timed_hash (exports, params) {
+    const { argon2_start, argon2_step, argon2_wipe } = exports;
+    const pass_seconds = [];
+
+    const begin = performance.now();
+    const { parallelism, memory_size_kb, iterations, password_length = 8 } = params;
+    const { length } = request(exports, {
+        parallelism, tag_length: default_tag_length, memory_size_kb, iterations, type: 'd',
+        password: new Uint8Array(password_length), salt: new Uint8Array(8), key: new Uint8Array(0), ad: new Uint8Array(0),
+    });
+    if (!length) {
+        throw new Error('Out of memory');
+    }
+
+    const start = performance.now();
+    if (!argon2_start(length)) {
+        throw new Error('Invalid parameters');
+    }
+    const start_seconds = (performance.now() - start) * 1e-3;
+
+    // Every call computes the rest of a slice.
+    for (let pass_r = 0; pass_r < params.iterations; ++pass_r) {
+        const pass_start = performance.now();
+        for (let slice_s = 0; slice_s < 4; ++slice_s) {
+            argon2_step(0);
+        }
+        pass_seconds.push((performance.now() - pass_start) * 1e-3);
+    }
+
+    argon2_wipe();
+    const seconds = (performance.now() - begin) * 1e-3;
+
+    return { seconds, start_seconds, pass_seconds };
+}
+
+
+// End-to-end latency of one hash, and the throughput of every pass.
+function latency (exports, params) {
+    const { parallelism, memory_size_kb, iterations } = params;
+
+    const latencies = [];
+    const best_pass_seconds = [];
+    for (let repetition = 0; repetition < repetitions; ++repetition) {
+        const { seconds, pass_seconds } = timed_hash(exports, params);
+        latencies.push(seconds);
+        pass_seconds.forEach((seconds, pass_r) => {
+            best_pass_seconds[pass_r] = Math.min(best_pass_seconds[pass_r] ?? Infinity, seconds);
+        });
+    }
+    latencies.sort((a, b) => a - b);
+
+    // The memory is rounded down to a multiple of 4 blocks per lane.
+    const bytes = Math.floor(memory_size_kb / (4 * parallelism)) * 4 * parallelism * 1024;
+
+    return {
+        type: 'd',
+        parallelism,
+        memory_size_kb,
+        iterations,
+        min_ms: round(latencies[0] * 1e3, 3),
+        median_ms: round(latencies[repetitions >> 1] * 1e3, 3),
+        pass_mb_s: best_pass_seconds.map(seconds => round(bytes / seconds * 1e-6, 1)),
+    };
+}
+
+
+// Nanoseconds per block of the later passes, including the index computation, like pass_block_ns of the native
+// benchmark. The compression function on its own (fill_block_ns natively) is not exported. The blocks stay in the cache.
+function pass_block (exports) {
+    const memory_size_kb = 1024;
+    const iterations = 4;
+
+    let best = Infinity;
+    for (let repetition = 0; repetition < repetitions; ++repetition) {
+        const { pass_seconds } = timed_hash(exports, { parallelism: 1, memory_size_kb, iterations });
+        // The first pass does not XOR, and creates the first blocks of the lanes.
+        best = Math.min(best, ...pass_seconds.slice(1));
+    }
+    return round(best * 1e9 / memory_size_kb, 2);
+}
+
+
+// MB/s of Blake2b, taken from the pre-hash of a long password.
+function blake2b (exports) {
+    const params = { parallelism: 1, memory_size_kb: 8, iterations: 1 };
+
+    let best_short = Infinity;
+    let best_long = Infinity;
+    for (let repetition = 0; repetition < repetitions; ++repetition) {
+        best_short = Math.min(best_short, timed_hash(exports, params).start_seconds);
+        best_long = Math.min(
+            best_long,
+            timed_hash(exports, { ...params, password_length: blake2b_message_length }).start_seconds,
+        );
+    }
+    return round(blake2b_message_length / (best_long - best_short) * 1e-6, 1);
+}
+
+
+// Nanoseconds per first block of a lane, taken from argon2_start() with many and with one lane. It computes the first
+// two blocks of every lane after the pre-hash.
+function hash_blocks (exports) {
+    const lanes = 16;
+
+    let best_one = Infinity;
+    let best_many = Infinity;
+    for (let repetition = 0; repetition < repetitions; ++repetition) {
+        best_one = Math.min(
+            best_one,
+            timed_hash(exports, { parallelism: 1, memory_size_kb: 8, iterations: 1 }).start_seconds,
+        );
+        best_many = Math.min(
+            best_many,
+            timed_hash(exports, { parallelism: lanes, memory_size_kb: 8 * lanes, iterations: 1 }).start_seconds,
+        );
+    }
+    return round((best_many - best_one) * 1e9 / (2 * (lanes - 1)), 2);
+}
+
+
+function round (value, digits) {
+    const factor = 10 ** digits;
+    return Math.round(value * factor) / factor;
+}
@@ -0,0 +1,266 @@
+// Conformance check of the WebAssembly modules in Node.js.
+// Every module is compared against the RFC 9106 test vectors, and all modules against each other on random inputs:
+//
+//     node src/check.js built/passwordhash.wasm built/passwordhash.simd.wasm [seed [cases]]
+//
+// The threaded module imports a shared memory, whose initial and maximum size in bytes are passed as they were linked.
+// It is checked once on its own, and once with a helper thread that computes lanes:
+//
+//     node src/check.js built/passwordhash.threads.wasm --memory=2097152,1075838976
+
+const { readFileSync } = require('fs');
+const { basename } = require('path');
+const { hash_types, instantiate_shared, start_thread, request } = require('./wasm_host.js');
+
+const {
+    WebAssembly, console, process, Math, Object, Uint8Array, Number, Error, parseInt,
+} = new Function('return this')();
+
+
+let failures = 0;
+
+run(process.argv.slice(2)).catch(ex => {
+    console.error(ex);
+    process.exitCode = 1;
+});
+
+
+async function run (args) {
+    const paths = args.filter(arg => arg.endsWith('.wasm'));
+    const options = args.filter(arg => arg.startsWith('--'));
+    const [seed = 0x13, cases = 100] = args.filter(arg => !arg.endsWith('.wasm') && !arg.startsWith('--')).map(Number);
+    const memory_limits = options.find(arg => arg.startsWith('--memory='))?.slice(9).split(',').map(Number);
+
+    const modules = [];
+    const threads = [];
+    for (const path of paths) {
+        const module = new WebAssembly.Module(readFileSync(path));
+        if (!WebAssembly.Module.imports(module).length) {
+            const { exports } = new WebAssembly.Instance(module);
+            modules.push({ name: basename(path), exports });
+            continue;
+        }
+
+        if (!memory_limits) {
+            throw new Error(`${path} imports its memory, pass --memory=initial,maximum`);
+        }
+        modules.push({ name: basename(path), exports: instantiate_shared(module, memory_limits).exports });
+
+        const { exports, memory } = instantiate_shared(module, memory_limits);
+        threads.push(await start_thread(module, memory, 0));
+        modules.push({ name: `${basename(path)} + 1 thread`, exports });
+    }
+
+    for (const module of modules) {
+        console.log(`Module ${module.name}`);
+        test_vectors(module);
+    }
+
+    console.log(`Random cases, seed ${seed}`);
+    const random = random_generator(seed);
+    for (let c = 0; c < cases; ++c) {
+        const input = random_input(random);
+        const max_blocks = Math.floor(random() * 300);
+
+        let expected = null;
+        for (const module of modules) {
+            const chunk_length = 1 + Math.floor(random() * 200);
+            const actual = [
+                hash(module, input), hash_steps(module, input, max_blocks), hash_prehash(module, input, chunk_length),
+            ];
+            expected ??= actual[0];
+            if (!expected || actual.some(tag => !equal(tag, expected))) {
+                fail(module, 'random input', input);
+            }
+        }
+    }
+
+    for (const thread of threads) {
+        thread.terminate();
+    }
+
+    if (failures) {
+        console.log(`${failures} FAILURES`);
+        process.exitCode = 1;
+    } else {
+        console.log(`All ${modules.length} modules agree`);
+    }
+}
+
+
+function fail ({ name }, what, { type, parallelism, tag_length, memory_size_kb, iterations, password, salt, key, ad }) {
+    ++failures;
+    console.log(
+        `FAIL ${what}: module=${name} type=${type} p=${parallelism} T=${tag_length} m=${memory_size_kb} ` +
+        `t=${iterations} pwd=${password.length} salt=${salt.length} key=${key.length} ad=${ad.length}`
+    );
+}
+
+
+// Copies the tag out of the module, and clears the memory.
+function tag ({ exports: { argon2_wipe, memory } }, B, { tag_length }) {
+    const result = new Uint8Array(memory.buffer, B, tag_length).slice();
+    argon2_wipe();
+    return result;
+}
+
+
+function hash (module, input) {
+    const { B, length } = request(module.exports, input);
+    if (!length || !module.exports.argon2(length)) {
+        return null;
+    }
+    return tag(module, B, input);
+}
+
+
+function hash_steps (module, input, max_blocks) {
+    const { argon2_start, argon2_step, argon2_step_pass } = module.exports;
+
+    const { B, length } = request(module.exports, input);
+    if (!length || !argon2_start(length)) {
+        return null;
+    }
+
+    // The passes are reported in order.
+    let done;
+    let pass = 0;
+    let passes_ordered = true;
+    do {
+        const next_pass = argon2_step_pass();
+        passes_ordered &&= next_pass >= pass && next_pass < input.iterations;
+        pass = next_pass;
+        done = argon2_step(max_blocks);
+    } while (done >= 0 && done < 1);
+    passes_ordered &&= argon2_step_pass() === input.iterations;
+
+    return done === 1 && passes_ordered ? tag(module, B, input) : null;
+}
+
+
+// Feeds the inputs in chunks of chunk_length bytes, like passwordhash.js does.
+function hash_prehash (module, input, chunk_length) {
+    const {
+        argon2_buffer, argon2_prehash_start, argon2_prehash_field, argon2_prehash_update, argon2_prehash_finish,
+        argon2_step, memory,
+    } = module.exports;
+    const { parallelism, tag_length, memory_size_kb, iterations, type, password, salt, key, ad } = input;
+
+    if (!argon2_prehash_start(parallelism, tag_length, memory_size_kb, iterations, hash_types[type])) {
+        return null;
+    }
+    for (const arr of [password, salt, key, ad]) {
+        if (!argon2_prehash_field(arr.length)) {
+            return null;
+        }
+        for (let pos = 0; pos < arr.length; pos += chunk_length) {
+            const chunk = arr.subarray(pos, pos + chunk_length);
+            const B = argon2_buffer(chunk.length);
+            if (!B) {
+                return null;
+            }
+            new Uint8Array(memory.buffer).set(chunk, B);
+            if (!argon2_prehash_update(chunk.length)) {
+                return null;
+            }
+        }
+    }
+    if (!argon2_prehash_finish()) {
+        return null;
+    }
+
+    let done;
+    do {
+        done = argon2_step(0);
+    } while (done >= 0 && done < 1);
+
+    return done === 1 ? tag(module, argon2_buffer(0), input) : null;
+}
+
+
+function equal (a, b) {
+    return a && b && a.length === b.length && a.every((value, index) => value === b[index]);
+}
+
+
+function from_hex (hex) {
+    return new Uint8Array(hex.match(/../g).map(byte => parseInt(byte, 16)));
+}
+
+
+function test_vectors (module) {
+    // RFC 9106, chapter 5
+    const rfc = {
+        parallelism: 4,
+        tag_length: 32,
+        memory_size_kb: 32,
+        iterations: 3,
+        password: new Uint8Array(32).fill(0x01),
+        salt: new Uint8Array(16).fill(0x02),
+        key: new Uint8Array(8).fill(0x03),
+        ad: new Uint8Array(12).fill(0x04),
+    };
+
+    const expected = {
+        d: '512b391b6f1162975371d30919734294f868e3be3984f3c1a13a4db9fabe4acb',
+        i: 'c814d9d1dc7f37aa13f0d77f2494bda1c8de6b016dd388d29952a4c4672b6ce8',
+        id: '0d640df58d78766c08c037a34a8b53c9d01ef0452d75b65eb52520e96b01e659',
+    };
+    for (const type of Object.keys(expected)) {
+        const input = { ...rfc, type };
+        if (!equal(hash(module, input), from_hex(expected[type]))) {
+            fail(module, `RFC 9106 Argon2${type}`, input);
+        }
+    }
+
+    // The default parameters use the specialized loop.
+    const defaults = {
+        parallelism: 1,
+        tag_length: 32,
+        memory_size_kb: 64 * 1024,
+        iterations: 4,
+        type: 'd',
+        password: new Uint8Array([...'test1234'].map(c => c.charCodeAt(0))),
+        salt: new Uint8Array([...'salt1234'].map(c => c.charCodeAt(0))),
+        key: new Uint8Array(0),
+        ad: new Uint8Array(0),
+    };
+    if (!equal(hash(module, defaults), from_hex('8aeb83cf9f9c450fdee9fd1f5922865e76cb1a242969d85af69985331dfa1f27'))) {
+        fail(module, 'default parameters', defaults);
+    }
+}
+
+
+// mulberry32
+function random_generator (seed) {
+    let state = seed >>> 0;
+    return function () {
+        state = (state + 0x6D2B79F5) >>> 0;
+        let z = state;
+        z = Math.imul(z ^ (z >>> 15), z | 1);
+        z ^= z + Math.imul(z ^ (z >>> 7), z | 61);
+        return ((z ^ (z >>> 14)) >>> 0) / 4294967296;
+    };
+}
+
+
+function random_input (random) {
+    const between = (low, high) => low + Math.floor(random() * (high - low + 1));
+    const bytes = length => new Uint8Array(length).map(() => between(0, 255));
+
+    // Lengths around the Blake2b block size are the interesting ones.
+    const password_lengths = [0, 1, 64, 127, 128, 129, 256, 300];
+
+    const parallelism = between(1, 6);
+    return {
+        parallelism,
+        tag_length: between(0, 3) ? between(4, 64) : between(65, 300),
+        memory_size_kb: between(8 * parallelism, 2048),
+        iterations: between(1, 3),
+        type: ['d', 'i', 'id'][between(0, 2)],
+        password: bytes(between(0, 1) ? password_lengths[between(0, 7)] : between(0, 300)),
+        salt: bytes(between(8, 40)),
+        key: bytes(between(0, 40)),
+        ad: bytes(between(0, 40)),
+    };
+}
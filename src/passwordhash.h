@@ -0,0 +1,173 @@
+#ifndef PASSWORDHASH_H
+#define PASSWORDHASH_H
+
+// Native interface of libpasswordhash: Argon2 version 1.3 (RFC 9106).
+//
+// A context owns the memory for the blocks, it is kept between two hashes and wiped after every hash.
+// One context computes one hash at a time, but different contexts can be used by different threads at the
+// same time, e.g. one context per thread.
+//
+// The lanes of a hash are computed on one thread pool for all contexts, with one thread less than there are CPUs.
+// The lanes of concurrent hashes queue on the pool, the oldest hash first. The calling thread computes lanes of its
+// own hash, too, so a hash never waits for the pool without making progress.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct argon2_ctx argon2_ctx;
+
+enum {
+    ARGON2_D = 0,
+    ARGON2_I = 1,
+    ARGON2_ID = 2,
+};
+
+// How the memory of the blocks is mapped. Memory of 2 MiB or more is always aligned to huge pages, and transparent
+// huge pages are requested for it.
+enum {
+    // Explicit huge pages from the pool of the system (vm.nr_hugepages). Small pages are used if there are not enough.
+    ARGON2_MEMORY_HUGETLB = 1,
+    // All pages are faulted in when the memory is allocated, instead of during the first pass.
+    ARGON2_MEMORY_PREFAULT = 2,
+};
+
+// Returns null if out of memory.
+argon2_ctx *argon2_ctx_new(void);
+
+// Sets the ARGON2_MEMORY_* flags for memory that is allocated later. The memory is kept for the next hash,
+// so they only take effect when a hash needs more memory than any hash before, or after argon2_ctx_release().
+void argon2_ctx_set_memory_flags(argon2_ctx *ctx, uint32_t flags);
+
+// Releases the memory of the context, a later hash allocates it again.
+void argon2_ctx_release(argon2_ctx *ctx);
+
+// Wipes and releases the memory of the context. ctx may be null.
+void argon2_ctx_free(argon2_ctx *ctx);
+
+// Writes tag_length bytes to tag, and returns 1.
+// Returns 0 if a parameter is out of range, or if the memory cannot be allocated:
+// parallelism 1 .. 2^24-1, tag_length 4 .. 1024, memory_size_kb 8 * parallelism .. 1 GiB,
+// iterations >= 1, hash_type ARGON2_D, ARGON2_I or ARGON2_ID, salt_length >= 8.
+int argon2_ctx_hash(
+    argon2_ctx *ctx,
+    uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+    uint32_t hash_type,
+    const void *password, uint32_t password_length,
+    const void *salt, uint32_t salt_length,
+    const void *key, uint32_t key_length,
+    const void *associated_data, uint32_t associated_data_length,
+    void *tag
+);
+
+// Returns 1 if the hash equals expected_tag (tag_length bytes), otherwise 0.
+// The tags are compared in constant time.
+int argon2_ctx_verify(
+    argon2_ctx *ctx,
+    uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+    uint32_t hash_type,
+    const void *password, uint32_t password_length,
+    const void *salt, uint32_t salt_length,
+    const void *key, uint32_t key_length,
+    const void *associated_data, uint32_t associated_data_length,
+    const void *expected_tag
+);
+
+// A hash whose inputs are fed in pieces, straight from the buffers of the caller:
+// after argon2_ctx_prehash_start(), every input (password, salt, key, associated data, in this order) is announced
+// with its whole length by argon2_ctx_prehash_field(), followed by any number of argon2_ctx_prehash_update() calls
+// with its bytes. argon2_ctx_prehash_finish() computes the hash, and writes tag_length bytes to tag.
+// Every call returns 1 on success. It returns 0 if a parameter is out of range or the call is out of order, then the
+// hash has to be started again.
+int argon2_ctx_prehash_start(
+    argon2_ctx *ctx,
+    uint32_t parallelism, uint32_t tag_length, uint32_t memory_size_kb, uint32_t iterations,
+    uint32_t hash_type
+);
+
+int argon2_ctx_prehash_field(argon2_ctx *ctx, uint32_t length);
+
+int argon2_ctx_prehash_update(argon2_ctx *ctx, const void *data, uint32_t length);
+
+int argon2_ctx_prehash_finish(argon2_ctx *ctx, void *tag);
+
+
+// Batch of hash and verify jobs, computed by a fixed number of worker threads.
+// A job only starts when its memory fits into the budget, together with the memory every worker keeps
+// for its next job. So the memory use stays bounded however many jobs are waiting.
+
+typedef struct argon2_batch argon2_batch;
+
+typedef struct argon2_job argon2_job;
+
+struct argon2_job {
+    uint32_t parallelism;
+    uint32_t tag_length;
+    uint32_t memory_size_kb;
+    uint32_t iterations;
+    uint32_t hash_type;
+    const void *password;
+    uint32_t password_length;
+    const void *salt;
+    uint32_t salt_length;
+    const void *key;
+    uint32_t key_length;
+    const void *associated_data;
+    uint32_t associated_data_length;
+
+    // If expected_tag is null, the tag is written to tag and result is 1 on success.
+    // Otherwise the hash is compared to expected_tag, and result is 1 if they are equal.
+    void *tag;
+    const void *expected_tag;
+
+    // Called on a worker thread when the job is done. The job and everything it points to must stay valid
+    // until then.
+    void (*complete)(argon2_job *job, int result);
+    void *user_data;
+
+    // Used by the batch while the job is queued.
+    argon2_job *internal_next;
+    double internal_submitted;
+};
+
+typedef struct {
+    uint32_t workers;           // 0: one per CPU
+    uint64_t memory_budget_kb;  // 0: 64 MiB per worker
+    uint32_t memory_flags;      // ARGON2_MEMORY_*
+} argon2_batch_config;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t completed;
+    uint32_t queued;            // jobs waiting now
+    uint32_t running;           // jobs being computed now
+    uint32_t max_queued;
+    uint64_t memory_kb;         // memory the workers keep now
+    uint64_t max_memory_kb;
+    double total_wait_seconds;  // from submission to start, summed over the completed jobs
+    double total_run_seconds;   // from start to completion, summed over the completed jobs
+    double max_latency_seconds; // from submission to completion
+} argon2_batch_stats;
+
+// Returns null if out of memory, or if no thread could be started. config may be null.
+argon2_batch *argon2_batch_new(const argon2_batch_config *config);
+
+// Queues a job and returns 1.
+// Returns 0 and does not call complete, if a parameter is out of range or the job needs more memory than the budget.
+int argon2_batch_submit(argon2_batch *batch, argon2_job *job);
+
+// Waits until every job that was submitted is done.
+void argon2_batch_wait(argon2_batch *batch);
+
+void argon2_batch_stats_get(argon2_batch *batch, argon2_batch_stats *stats);
+
+// Waits for the remaining jobs, stops the workers and releases their memory. batch may be null.
+void argon2_batch_free(argon2_batch *batch);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // PASSWORDHASH_H
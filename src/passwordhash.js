@@ -1,27 +1,81 @@
 const {
-    fetch, Request, WebAssembly, console, TextEncoder, document,
-    Uint8Array, DataView, Promise, Worker, location, self, URL,
+    fetch, Request, WebAssembly, console, TextEncoder, document, navigator, Math, crypto,
+    Uint8Array, Uint32Array, DataView, Promise, Worker, location, self, URL, SharedArrayBuffer,
+    setTimeout, clearTimeout, MessageChannel, Map, Date, Array, JSON, requestIdleCallback, performance,
 } = new Function('return this')();
 
 const current_script_src = document?.currentScript?.src;
 
+const thread_worker_name = 'argon2-thread';
+
+const default_parallelism = 1;
+const default_tag_length = 32;
+const default_memory_size_kb = 64 * 1024;
+const default_iterations = 4;
+const default_type = 'd';
+
 
 if (current_script_src) {
     run_script();
+} else if (self.name === thread_worker_name) {
+    run_thread();
 } else {
     run_worker();
 }
 
 
 function run_script () {
+    const hardware_concurrency = navigator.hardwareConcurrency || 1;
+
+    const config = {
+        // Every worker computes one hash at a time.
+        max_workers: Math.min(4, hardware_concurrency),
+        // Further requests are only started while the memory costs of the running requests fit into the budget.
+        memory_budget_kb: 4 * default_memory_size_kb,
+        // Opt-in: the page keeps the tags of this many recent hashes, so that a repeated request is answered without
+        // computing it again. 0 turns the cache off.
+        cache_entries: 0,
+        // A tag is dropped from the cache after this many milliseconds.
+        cache_ttl_ms: 60 * 1000,
+        // The first worker is started while the page is idle, so that its module is ready for the first request.
+        prewarm: true,
+        // Workers that start later use the SIMD module where the browser supports it. It is off, because it has not
+        // been measured faster than the MVP module.
+        simd: false,
+    };
+
     let next_callid = 0;
 
-    const promises = Object.create(null);
+    // Waiting requests, ordered by descending priority, then by call order.
+    const queue = [];
+    const running = Object.create(null);
+    // Waiting and running requests by their inputs. Identical requests share one computation.
+    const computations = new Map();
+    let running_count = 0;
+    let memory_in_use_kb = 0;
+
+    const idle_workers = [];
+    const workers = [];
+    let worker_count = 0;
+
+    // Tags of recent hashes with the key of their inputs, the oldest entry first. Keys and tags are kept in arrays,
+    // so that they can be zeroed when they are dropped. The workers compute the keys, digests under this secret,
+    // so they are worthless once it is replaced.
+    const cache = [];
+    let cache_secret = crypto.getRandomValues(new Uint8Array(32));
+
+    // Helper threads of the threaded module that every worker may start, and their sum. One CPU is kept for every
+    // worker that may run at once, so that concurrent hashes and their helpers do not oversubscribe the CPUs.
+    const helper_grants = new Map();
+    let helpers_granted = 0;
 
-    const worker_promise = (
+    const script_promise = (
         fetch(current_script_src, { cache: 'force-cache' }).
-        then(response => response.blob()).
-        then(blob => {
+        then(response => response.blob())
+    );
+
+    function create_worker () {
+        return script_promise.then(blob => {
             let new_worker;
             const url = URL.createObjectURL(blob)
             try {
@@ -29,134 +83,927 @@ function run_script () {
             } finally {
                 URL.revokeObjectURL(url);
             }
-            new_worker.addEventListener('message', ({ data: { success, data, callid } }) => {
-                const resolve_reject = promises[callid];
-                delete promises[callid];
-                if (resolve_reject) {
-                    resolve_reject[+success](data);
+            new_worker.addEventListener('message', ({
+                data: { success, aborted, data, callid, progress, digest, timings },
+            }) => {
+                if (digest) {
+                    cache_lookup(new_worker, callid, digest);
+                    return;
+                } else if (progress !== undefined) {
+                    for (const caller of running[callid]?.callers ?? []) {
+                        caller.onprogress?.(progress);
+                    }
+                    return;
                 }
+
+                finish(callid, success, data, aborted, timings);
+                idle_workers.push(new_worker);
+                schedule();
             });
+            // The worker needs its own source to start the threads of the threaded module,
+            // and the address of the script to find the modules that are served next to it.
+            new_worker.postMessage({ script: blob, base: current_script_src, simd: config.simd });
+            new_worker.postMessage({ cache: cache_config() });
+            workers.push(new_worker);
             return new_worker;
-        })
-    );
+        });
+    }
+
+    // Lets the worker start up to one helper less than the parallelism of its request, as far as the CPUs allow.
+    // A grant is never taken back, the worker keeps its helpers for later requests.
+    function grant_helpers (worker, parallelism = default_parallelism) {
+        if (!self.crossOriginIsolated || !SharedArrayBuffer) {
+            return;
+        }
+
+        const granted = helper_grants.get(worker) ?? 0;
+        const available = Math.max(0, hardware_concurrency - config.max_workers - helpers_granted);
+        const more = Math.min(available, parallelism - 1 - granted);
+        if (more > 0) {
+            helper_grants.set(worker, granted + more);
+            helpers_granted += more;
+            worker.postMessage({ max_helpers: granted + more });
+        }
+    }
+
+    // The workers only compute the keys while the cache is on.
+    function cache_config () {
+        return { secret: config.cache_entries > 0 ? cache_secret : null };
+    }
+
+    function cache_drop (index) {
+        const [{ digest, tag }] = cache.splice(index, 1);
+        digest.fill(0);
+        tag.fill(0);
+    }
+
+    // Drops the expired entries, and the oldest entries above the limit.
+    function cache_trim () {
+        const now = Date.now();
+        for (let index = 0; index < cache.length;) {
+            if (cache[index].expires <= now || cache.length > config.cache_entries) {
+                cache_drop(index);
+            } else {
+                ++index;
+            }
+        }
+    }
+
+    function cache_wipe () {
+        while (cache.length) {
+            cache_drop(0);
+        }
+        cache_secret.fill(0);
+        cache_secret = crypto.getRandomValues(new Uint8Array(32));
+        for (const worker of workers) {
+            worker.postMessage({ cache: cache_config() });
+        }
+    }
+
+    function cache_find (digest) {
+        return cache.findIndex(entry => entry.digest.every((byte, index) => byte === digest[index]));
+    }
+
+    function cache_get (digest) {
+        cache_trim();
+        const index = cache_find(digest);
+        if (index < 0) {
+            return null;
+        }
+
+        // The entry becomes the newest one.
+        const [entry] = cache.splice(index, 1);
+        cache.push(entry);
+        return entry.tag.slice();
+    }
+
+    // Takes ownership of digest.
+    function cache_put (digest, tag) {
+        cache_trim();
+        const index = cache_find(digest);
+        if (index >= 0) {
+            cache_drop(index);
+        }
+        if (config.cache_entries > 0) {
+            const expires = Date.now() + config.cache_ttl_ms;
+            cache.push({ digest, tag: tag.slice(), expires });
+            cache_trim();
+        } else {
+            digest.fill(0);
+        }
+    }
+
+    // A worker asks for the tag of its request once it knows the key. All workers share the cache, so a repeated
+    // request is found whichever worker computed it first. On a miss the job keeps the key for its tag.
+    function cache_lookup (worker, callid, digest) {
+        const job = running[callid];
+        const tag = job ? cache_get(digest) : null;
+        if (job && !tag) {
+            job.digest = digest;
+        } else {
+            digest.fill(0);
+        }
+        worker.postMessage({ cached: callid, tag });
+        tag?.fill(0);
+    }
+
+    function settle (caller, success, data) {
+        caller.signal?.removeEventListener('abort', caller.on_abort);
+        caller.resolve_reject[+success](data);
+    }
+
+    function forget (job) {
+        if (computations.get(job.inputs) === job) {
+            computations.delete(job.inputs);
+        }
+    }
+
+    // The phases of the main thread and of the worker, in milliseconds. Every caller gets its own copy.
+    function report_timings (job, timings) {
+        const total = performance.now() - job.created;
+        for (const caller of job.callers) {
+            caller.ontimings?.({ ...job.timings, ...timings, passes: [...timings?.passes ?? []], total });
+        }
+    }
+
+    function finish (callid, success, data, aborted, timings) {
+        const job = running[callid];
+        if (job) {
+            delete running[callid];
+            --running_count;
+            memory_in_use_kb -= job.memory_size_kb;
+            forget(job);
+            if (job.digest) {
+                if (success && !aborted) {
+                    cache_put(job.digest, data);
+                } else {
+                    job.digest.fill(0);
+                }
+                job.digest = null;
+            }
+            if (job.timings) {
+                report_timings(job, timings);
+            }
+            // Every caller gets a tag of its own.
+            job.callers.forEach((caller, index) => {
+                settle(caller, success, aborted ? job.abort_reason : index ? data?.slice() : data);
+            });
+        }
+    }
+
+    function schedule () {
+        while (queue.length) {
+            const [job] = queue;
+            if (running_count > 0 && memory_in_use_kb + job.memory_size_kb > config.memory_budget_kb) {
+                break;
+            }
 
-    self.argon2_hash = ({password, salt, key, ad}) => {
+            let worker_promise;
+            if (idle_workers.length) {
+                worker_promise = Promise.resolve(idle_workers.pop());
+            } else if (worker_count < config.max_workers) {
+                ++worker_count;
+                worker_promise = create_worker();
+            } else {
+                break;
+            }
+
+            queue.shift();
+            running[job.callid] = job;
+            ++running_count;
+            memory_in_use_kb += job.memory_size_kb;
+
+            // The timings are only measured if a caller asked for them.
+            const dispatched = performance.now();
+            if (job.callers.some(caller => caller.ontimings)) {
+                job.timings = { queued: dispatched - job.created };
+            }
+
+            worker_promise.then(worker => {
+                job.worker = worker;
+                if (job.timings) {
+                    job.timings.worker = performance.now() - dispatched;
+                    // The clocks of the page and the worker only share their time origin.
+                    job.data.posted = performance.timeOrigin + performance.now();
+                }
+                grant_helpers(worker, job.data.parallelism);
+                worker.postMessage(job.data);
+                if (job.abort_reason !== undefined) {
+                    worker.postMessage({ abort: job.callid });
+                }
+            }).catch(() => {
+                console.log('Could not initialize worker');
+                --worker_count;
+                finish(job.callid, false);
+            });
+        }
+    }
+
+    // A caller that shares the computation with other callers is dropped at once.
+    // A waiting request is dropped at once, a running request is stopped by its worker after the current step.
+    function cancel (job, caller, reason) {
+        if (job.callers.length > 1) {
+            job.callers.splice(job.callers.indexOf(caller), 1);
+            settle(caller, false, reason);
+            return;
+        }
+
+        const index = queue.indexOf(job);
+        if (index >= 0) {
+            queue.splice(index, 1);
+            forget(job);
+            settle(caller, false, reason);
+        } else if (running[job.callid] && job.abort_reason === undefined) {
+            job.abort_reason = reason;
+            // A new identical request must not wait for the aborted one.
+            forget(job);
+            job.worker?.postMessage({ abort: job.callid });
+        }
+    }
+
+    // A request with a group supersedes the other requests of the same group, e.g. while the user is typing.
+    function supersede (group, except) {
+        for (const job of [...queue, ...Object.values(running)]) {
+            for (const caller of [...job.callers]) {
+                if (caller.group === group && caller !== except) {
+                    cancel(job, caller, 'superseded');
+                }
+            }
+        }
+    }
+
+    function enqueue (job) {
+        let index = queue.length;
+        while (index > 0 && queue[index - 1].priority < job.priority) {
+            --index;
+        }
+        queue.splice(index, 0, job);
+    }
+
+    self.argon2_configure = ({
+        max_workers, memory_budget_kb, cache_entries, cache_ttl_ms, prewarm, simd,
+    } = {}) => {
+        if (max_workers !== undefined) {
+            config.max_workers = Math.max(1, Math.min(hardware_concurrency, max_workers | 0));
+        }
+        if (memory_budget_kb !== undefined) {
+            config.memory_budget_kb = Math.max(0, +memory_budget_kb || 0);
+        }
+        if (prewarm !== undefined) {
+            config.prewarm = !!prewarm;
+        }
+        if (simd !== undefined) {
+            config.simd = !!simd;
+        }
+        if (cache_entries !== undefined || cache_ttl_ms !== undefined) {
+            if (cache_entries !== undefined) {
+                config.cache_entries = Math.max(0, cache_entries | 0);
+            }
+            if (cache_ttl_ms !== undefined) {
+                config.cache_ttl_ms = Math.max(0, +cache_ttl_ms || 0);
+            }
+            cache_trim();
+            for (const worker of workers) {
+                worker.postMessage({ cache: cache_config() });
+            }
+        }
+        schedule();
+        return { ...config };
+    };
+
+    // Clears the cached tags and replaces the secret of their keys.
+    self.argon2_wipe_cache = () => {
+        cache_wipe();
+    };
+
+    self.argon2_hash = ({
+        password, salt, key, ad,
+        parallelism = default_parallelism,
+        memory_size_kb = default_memory_size_kb,
+        iterations = default_iterations,
+        tag_length = default_tag_length,
+        type = default_type,
+        priority = 0, group, signal, onprogress, ontimings,
+    }) => {
         if ((salt || '').length < 8) {
             return Promise.reject('no salt');
+        } else if (signal?.aborted) {
+            return Promise.reject(signal.reason);
         }
 
         return new Promise((resolve, reject) => {
-            const callid = ++next_callid;
-            const data = { callid, password, salt, key, ad };
+            const caller = {
+                group, signal, onprogress, ontimings,
+                resolve_reject: [reject, resolve],
+                on_abort: () => cancel(job, caller, signal.reason),
+            };
 
-            promises[callid] = [reject, resolve];
+            const inputs = JSON.stringify([
+                password || '', salt, key || '', ad || '', parallelism, memory_size_kb, iterations, tag_length, type,
+            ]);
+            let job = computations.get(inputs);
+            if (job) {
+                job.callers.push(caller);
+                // The shared computation runs with the highest priority of its callers.
+                if (priority > job.priority && queue.includes(job)) {
+                    queue.splice(queue.indexOf(job), 1);
+                    job.priority = priority;
+                    enqueue(job);
+                }
+            } else {
+                const callid = ++next_callid;
+                const data = {
+                    callid, password, salt, key, ad, parallelism, memory_size_kb, iterations, tag_length, type,
+                };
+                job = {
+                    callid, data, inputs, priority,
+                    memory_size_kb: memory_size_kb || default_memory_size_kb,
+                    callers: [caller],
+                    created: performance.now(),
+                    timings: null,
+                };
+                computations.set(inputs, job);
+                enqueue(job);
+            }
+            signal?.addEventListener('abort', caller.on_abort, { once: true });
 
-            worker_promise.then(worker => { worker.postMessage(data); }).catch(() => {
-                console.log('Could not initialize worker');
-                delete promises[callid];
-                reject();
-            });
+            if (group !== undefined) {
+                supersede(group, caller);
+            }
+            schedule();
         });
     };
+
+    // Measured cost of a block by hash type and parallelism, see argon2_calibrate().
+    const calibrations = new Map();
+    // The cost of a block grows with the memory, as fewer blocks stay in the caches and the TLB. So it is measured
+    // at two sizes, the larger one the default memory size.
+    const calibration_memory_sizes_kb = [16 * 1024, 64 * 1024];
+
+    // Hashes memory_size_kb twice on this device. The first pass also faults in the memory, so it is measured
+    // separately.
+    function measure_size (type, parallelism, memory_size_kb) {
+        // A fresh salt, so that the tag never comes from the cache or from another request.
+        const salt = Array.from(
+            crypto.getRandomValues(new Uint8Array(16)),
+            byte => byte.toString(16).padStart(2, '0'),
+        ).join('');
+
+        let timings;
+        return self.argon2_hash({
+            password: 'calibration', salt, type, parallelism, memory_size_kb, iterations: 2,
+            ontimings: t => {
+                timings = t;
+            },
+        }).then(() => {
+            if (timings?.passes.length !== 2) {
+                return Promise.reject('could not measure');
+            }
+            const [first_pass, later_pass] = timings.passes.map(ms => ms * 1e6 / memory_size_kb);
+            return { memory_size_kb, first_pass_block_ns: first_pass, block_ns: later_pass };
+        });
+    }
+
+    // Measures the sizes one after the other, so that they do not compete for the CPUs and the memory bandwidth.
+    function measure_blocks (type, parallelism) {
+        const key = `${type},${parallelism}`;
+        let measurement = calibrations.get(key);
+        if (!measurement) {
+            const [small, large] = calibration_memory_sizes_kb;
+            measurement = measure_size(type, parallelism, small).then(
+                small => measure_size(type, parallelism, large).then(large => [small, large]),
+            );
+            measurement.catch(() => calibrations.delete(key));
+            calibrations.set(key, measurement);
+        }
+        return measurement;
+    }
+
+    // Cost of a block of a hash with memory_size_kb, interpolated between the two measured sizes on a logarithmic
+    // scale, and extrapolated beyond them with the same slope. The cost is not assumed to fall with the memory.
+    function block_cost ([small, large], memory_size_kb) {
+        const position = Math.max(
+            0, Math.log2(memory_size_kb / small.memory_size_kb) / Math.log2(large.memory_size_kb / small.memory_size_kb),
+        );
+        const scale = name => small[name] + position * Math.max(0, large[name] - small[name]);
+        return { first_pass_block_ns: scale('first_pass_block_ns'), block_ns: scale('block_ns') };
+    }
+
+    // Recommends the strongest parameters whose hash is expected to take at most target_ms on this device:
+    // the largest memory size, then the most iterations, or the strongest of the allowed candidates
+    // ([{memory_size_kb, iterations}, ...]). The measurement is done once per page, type and parallelism.
+    self.argon2_calibrate = ({
+        target_ms,
+        type = default_type,
+        parallelism = default_parallelism,
+        min_memory_size_kb = 8 * 1024,
+        max_memory_size_kb = Math.min(config.memory_budget_kb, 1024 * 1024),
+        min_iterations = 1,
+        max_iterations = 16,
+        candidates,
+    }) => measure_blocks(type, parallelism).then(measurements => {
+        const estimate = ({ memory_size_kb, iterations }) => {
+            const { first_pass_block_ns, block_ns } = block_cost(measurements, memory_size_kb);
+            return memory_size_kb * (first_pass_block_ns + (iterations - 1) * block_ns) / 1e6;
+        };
+
+        if (!candidates) {
+            candidates = [];
+            for (let memory_size_kb = max_memory_size_kb; memory_size_kb >= min_memory_size_kb; memory_size_kb >>>= 1) {
+                const { first_pass_block_ns, block_ns } = block_cost(measurements, memory_size_kb);
+                const pass_ms = memory_size_kb * block_ns / 1e6;
+                const first_pass_ms = memory_size_kb * first_pass_block_ns / 1e6;
+                const iterations = Math.min(max_iterations, 1 + Math.floor((target_ms - first_pass_ms) / pass_ms));
+                if (iterations >= min_iterations) {
+                    candidates.push({ memory_size_kb, iterations });
+                    break;
+                }
+            }
+        }
+
+        // The strongest candidate is the one with the most work, or with more memory for the same work.
+        let best = null;
+        for (const candidate of candidates) {
+            const estimated_ms = estimate(candidate);
+            const strength = candidate.memory_size_kb * candidate.iterations;
+            if (estimated_ms > target_ms) {
+                continue;
+            } else if (
+                !best || strength > best.strength ||
+                (strength === best.strength && candidate.memory_size_kb > best.memory_size_kb)
+            ) {
+                best = { ...candidate, estimated_ms, strength };
+            }
+        }
+        if (!best) {
+            return Promise.reject('target not reachable');
+        }
+
+        const { memory_size_kb, iterations, estimated_ms } = best;
+        const { first_pass_block_ns, block_ns } = block_cost(measurements, memory_size_kb);
+        return { type, parallelism, memory_size_kb, iterations, estimated_ms, first_pass_block_ns, block_ns };
+    });
+
+    (requestIdleCallback || setTimeout)(() => {
+        if (!config.prewarm || worker_count > 0) {
+            return;
+        }
+
+        ++worker_count;
+        create_worker().then(worker => {
+            idle_workers.push(worker);
+            schedule();
+        }).catch(() => {
+            console.log('Could not initialize worker');
+            --worker_count;
+        });
+    });
+}
+
+
+function run_thread () {
+    self.addEventListener('message', ({ data: { module, memory, index } }) => {
+        WebAssembly.instantiate(module, { env: { memory } }).
+        then(instance => {
+            const { exports: { __stack_pointer, thread_stacks, thread_stack_layout, argon2_thread } } = instance;
+            const [stack_size] = new Uint32Array(memory.buffer, thread_stack_layout.value, 2);
+
+            __stack_pointer.value = thread_stacks.value + (index + 1) * stack_size;
+            argon2_thread();  // does not return
+        }).
+        catch(ex => {
+            console.warn('Could not start hashing thread', ex);
+        });
+    }, { once: true });
 }
 
 
 function run_worker () {
-    const parallelism = 1;
-    const tag_length = 32;
-    const memory_size_kb = 64 * 1024;
-    const iterations = 4;
-    const version = 0x13;
-    const hash_type = 0;  // d
+    const hash_types = { d: 0, i: 1, id: 2 };
+
+    // An idle instance is dropped after this many milliseconds, so that the memory of the blocks is released.
+    const idle_timeout = 30 * 1000;
+
+    // Blocks per lane that are computed between two progress events, and before an abort request is noticed.
+    const step_blocks = 4096;
+
+    // The inputs are copied into the module in chunks of this many bytes, so they never have to fit into the
+    // memory at once.
+    const chunk_length = 64 * 1024;
 
     const to_hash = [];
 
-    function argon2_fn (obj) {
-        to_hash.push(obj);
+    // The secret of the keys of the cache of the page, null while the cache is off.
+    let cache_secret = null;
+
+    // Helper threads the page allows this worker to start.
+    let max_helpers = 0;
+
+    let instance = null;
+    let instantiating = false;
+    let current = null;
+    let idle_timer;
+
+    let resolve_setup;
+    const setup_promise = new Promise(resolve => {
+        resolve_setup = resolve;
+    });
+
+    self.addEventListener('message', ({ data }) => {
+        if (data.script) {
+            resolve_setup(data);
+        } else if (data.abort) {
+            abort(data.abort);
+        } else if (data.cache) {
+            cache_secret?.fill(0);
+            ({ secret: cache_secret } = data.cache);
+        } else if (data.cached !== undefined) {
+            resume(data);
+        } else if (data.max_helpers !== undefined) {
+            ({ max_helpers } = data);
+        } else {
+            data.received = performance.now();
+            to_hash.push(data);
+            pump();
+        }
+    });
+
+    // Yields to the event loop without the minimum delay of setTimeout(), so that abort requests are received.
+    const yield_channel = new MessageChannel();
+    yield_channel.port1.onmessage = () => step();
+
+    function compile_buffer (url) {
+        return (
+            fetch(url).
+            then(response => response.arrayBuffer()).
+            then(buffer => WebAssembly.compile(buffer))
+        );
     }
 
-    function set_fn (fn) {
-        try {
-            while (to_hash.length) {
-                try {
-                    // Process as LIFO queue. The last message is most likely the most important.
-                    fn(to_hash.pop());
-                } catch (ex) {
-                    console.warn('Error in chained callback', ex);
+    // A module is either embedded as a data URI, or served next to the script. A served module is compiled while
+    // it is downloaded, and the browser can keep the compiled code for the next page load.
+    function compile (src) {
+        return setup_promise.then(({ base }) => {
+            const url = new URL(src, base).href;
+            if (!WebAssembly.compileStreaming) {
+                return compile_buffer(url);
+            }
+            return WebAssembly.compileStreaming(fetch(url)).catch(ex => {
+                // E.g. the server does not send the module as application/wasm.
+                console.warn('Could not compile WebAssembly while downloading', ex);
+                return compile_buffer(url);
+            });
+        });
+    }
+
+    // The compiled modules are kept, only the instances are recycled.
+    const modules = Object.create(null);
+
+    function compile_once (src) {
+        return modules[src] || (modules[src] = compile(src));
+    }
+
+    function instantiate (src) {
+        return (
+            compile_once(src).
+            then(module => WebAssembly.instantiate(module)).
+            then(instance => ({ exports: instance.exports, memory: instance.exports.memory, prepare () {}, close () {} }))
+        );
+    }
+
+    // Shared memory is only available if the page is cross-origin isolated.
+    function instantiate_threads () {
+        return Promise.all([
+            compile_once(wasm_threads_src),
+            setup_promise,
+        ]).
+        then(([module, { script }]) => {
+            const memory = new WebAssembly.Memory({
+                initial: wasm_threads_memory / 65536,
+                maximum: wasm_threads_max_memory / 65536,
+                shared: true,
+            });
+
+            return WebAssembly.instantiate(module, { env: { memory } }).then(({ exports }) => {
+                const { thread_stack_layout } = exports;
+                const [, max_threads] = new Uint32Array(memory.buffer, thread_stack_layout.value, 2);
+
+                // Every helper loads the whole script, so they are only started once a request can use them,
+                // up to one less than its parallelism and as many as the page allows. The thread pool works with
+                // however many have started.
+                const threads = [];
+                function prepare (parallelism) {
+                    const wanted = Math.min(max_threads, max_helpers, parallelism - 1);
+                    if (threads.length >= wanted) {
+                        return;
+                    }
+
+                    const url = URL.createObjectURL(script);
+                    try {
+                        while (threads.length < wanted) {
+                            const thread = new Worker(url, { name: thread_worker_name });
+                            thread.postMessage({ module, memory, index: threads.length });
+                            threads.push(thread);
+                        }
+                    } finally {
+                        URL.revokeObjectURL(url);
+                    }
+                }
+
+                function close () {
+                    for (const thread of threads) {
+                        thread.terminate();
+                    }
                 }
+
+                return { exports, memory, prepare, close };
+            });
+        });
+    }
+
+    // (func (result v128) (i8x16.popcnt (i8x16.splat (i32.const 0))))
+    const simd_test_module = new Uint8Array([
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x05, 0x01, 0x60,
+        0x00, 0x01, 0x7b, 0x03, 0x02, 0x01, 0x00, 0x0a, 0x0a, 0x01, 0x08, 0x00,
+        0x41, 0x00, 0xfd, 0x0f, 0xfd, 0x62, 0x0b,
+    ]);
+
+    let simd_supported = false;
+    try {
+        simd_supported = WebAssembly.validate(simd_test_module);
+    } catch (ex) {
+        // WebAssembly is not available at all. The MVP module will fail below, too.
+    }
+
+    function instantiate_single () {
+        return setup_promise.then(({ simd }) => (
+            simd && simd_supported ?
+            instantiate(wasm_simd_src).catch(ex => {
+                console.warn('Could not initialize WebAssembly SIMD module, falling back to MVP', ex);
+                return instantiate(wasm_src);
+            }) :
+            instantiate(wasm_src)
+        ));
+    }
+
+    function instantiate_any () {
+        return (
+            self.crossOriginIsolated && SharedArrayBuffer ?
+            instantiate_threads().catch(ex => {
+                console.warn('Could not initialize threaded WebAssembly module, falling back to one thread', ex);
+                return instantiate_single();
+            }) :
+            instantiate_single()
+        );
+    }
+
+    function release () {
+        if (instance && !current) {
+            instance.close();
+            instance = null;
+        }
+    }
+
+    function start () {
+        if (instance || instantiating) {
+            return;
+        }
+
+        instantiating = true;
+        instantiate_any().
+        then(new_instance => {
+            instance = new_instance;
+        }).
+        catch(ex => {
+            console.warn('Could not initialize WebAssembly', ex);
+
+            // Try again with the next request.
+            while (to_hash.length) {
+                const { callid } = to_hash.pop();
+                const success = false;
+                self.postMessage({ success, callid });
             }
-        } finally {
-            argon2_fn = fn;
+        }).
+        finally(() => {
+            instantiating = false;
+            pump();
+        });
+    }
+
+    function pump () {
+        if (current || !to_hash.length) {
+            return;
+        } else if (!instance) {
+            start();
+            return;
         }
+
+        clearTimeout(idle_timer);
+        // The page orders the requests and hands an idle worker a single one, so this is the job it was sent.
+        begin(to_hash.shift());
     }
 
-    self.addEventListener('message', ({ data }) => {
-        argon2_fn(data);
-    });
+    function abort (callid) {
+        if (current?.callid === callid) {
+            current.aborted = true;
+        } else {
+            const index = to_hash.findIndex(data => data.callid === callid);
+            if (index >= 0) {
+                to_hash.splice(index, 1);
+                const success = false;
+                const aborted = true;
+                self.postMessage({ success, aborted, callid });
+            }
+        }
+    }
 
+    // Adds the time since `since` to a phase of the current request, if its timings are measured.
+    // Returns the current time.
+    function lap (phase, since) {
+        const now = performance.now();
+        const { timings } = current;
+        if (timings) {
+            timings[phase] += now - since;
+        }
+        return now;
+    }
 
-    fetch(wasm_data_uri).
-    then(response => response.arrayBuffer()).
-    then(buffer => WebAssembly.instantiate(buffer)).
-    then(obj => {
-        const { instance: { exports: { B, argon2, memory: { buffer } } } } = obj;
+    function begin ({
+        callid, password, salt, key, ad,
+        parallelism = default_parallelism,
+        memory_size_kb = default_memory_size_kb,
+        iterations = default_iterations,
+        tag_length = default_tag_length,
+        type = default_type,
+        posted, received,
+    }) {
+        let time = performance.now();
+        const timings = posted === undefined ? null : {
+            // Includes the start of the worker script, if the request started the worker.
+            delivery: performance.timeOrigin + received - posted,
+            // Waiting for the module to be compiled and instantiated.
+            instantiate: time - received,
+            // The first blocks are computed by argon2_prehash_finish(), the last pass includes finalize().
+            prehash: 0, initialize: 0, passes: [], wipe: 0,
+        };
+        current = { callid, tag_length, B: 0, aborted: false, timings };
+        try {
+            const {
+                exports: {
+                    argon2_buffer, argon2_prehash_start, argon2_prehash_field, argon2_prehash_update,
+                    argon2_prehash_digest,
+                },
+                memory,
+            } = instance;
 
-        set_fn(function ({ callid, password, salt, key, ad }) {
-            let success = false;
-            let data;
-            try {
-                const u8view = new Uint8Array(buffer);
-                try {
-                    const dataview = new DataView(buffer);
-
-                    dataview.setUint32(B + 4 * 0, parallelism,    true);
-                    dataview.setUint32(B + 4 * 1, tag_length,     true);
-                    dataview.setUint32(B + 4 * 2, memory_size_kb, true);
-                    dataview.setUint32(B + 4 * 3, iterations,     true);
-                    dataview.setUint32(B + 4 * 4, version,        true);
-                    dataview.setUint32(B + 4 * 5, hash_type,      true);
-
-                    let memory_pos = B + 4 * 6;
-
-                    function put_str (s) {
-                        if (!s) {
-                            dataview.setUint32(memory_pos, 0, true);
-                            memory_pos += 4;
-                        } else {
-                            const arr = (new TextEncoder).encode(s);
-                            const { length } = arr;
-
-                            dataview.setUint32(memory_pos, length, true);
-                            memory_pos += 4;
-
-                            u8view.set(arr, memory_pos);
-                            memory_pos += length;
-                        }
+            instance.prepare(parallelism);
+
+            const encoder = new TextEncoder;
+            const strs = [password, salt, key, ad].map(s => s ? encoder.encode(s) : new Uint8Array(0));
+
+            if (!argon2_prehash_start(parallelism, tag_length, memory_size_kb, iterations, hash_types[type] ?? -1)) {
+                finish(false);
+                return;
+            }
+
+            for (const arr of strs) {
+                if (!argon2_prehash_field(arr.length)) {
+                    finish(false);
+                    return;
+                }
+
+                for (let pos = 0; pos < arr.length; pos += chunk_length) {
+                    const chunk = arr.subarray(pos, pos + chunk_length);
+                    const B = argon2_buffer(chunk.length);
+                    if (!B) {
+                        throw new Error('Out of memory');
                     }
 
-                    put_str(password);
-                    put_str(salt);
-                    put_str(key);
-                    put_str(ad);
+                    // The memory might have grown, so the view has to be created anew.
+                    new Uint8Array(memory.buffer).set(chunk, B);
+                    if (!argon2_prehash_update(chunk.length)) {
+                        finish(false);
+                        return;
+                    }
+                }
+            }
 
-                    success = !!argon2(memory_pos - B);
-                    data = u8view.slice(B, B + tag_length);
-                } finally {
-                    u8view.subarray(B, B + 1024 * memory_size_kb).fill(0);
+            if (cache_secret) {
+                const B = argon2_buffer(cache_secret.length);
+                if (!B) {
+                    throw new Error('Out of memory');
+                }
+                new Uint8Array(memory.buffer).set(cache_secret, B);
+
+                const digest = argon2_prehash_digest(cache_secret.length);
+                if (digest) {
+                    // The page answers with the cached tag or null, see resume().
+                    const view = new Uint8Array(memory.buffer, digest, 64);
+                    self.postMessage({ callid, digest: view.slice() });
+                    view.fill(0);
+                    current.time = time;
+                    return;
                 }
-            } catch (ex) {
-                console.warn('Could not hash', ex);
             }
-            self.postMessage({ success, data, callid });
-        });
-    }).
-    catch(ex => {
-        console.warn('Could not initialize WebAssembly', ex);
-
-        set_fn(function (data) {
-            const { callid } = data;
-            const success = false;
-            self.postMessage({ success, callid });
-        });
-    });
+        } catch (ex) {
+            console.warn('Could not hash', ex);
+            finish(false);
+            return;
+        }
+        initialize(time);
+    }
+
+    // The answer of the page to the key of the current request.
+    function resume ({ cached, tag }) {
+        if (current?.callid !== cached) {
+            tag?.fill(0);
+        } else if (current.aborted) {
+            tag?.fill(0);
+            finish(false);
+        } else if (tag) {
+            lap('prehash', current.time);
+            finish(true, tag);
+        } else {
+            initialize(current.time);
+        }
+    }
+
+    // Computes the first blocks and the rest of the hash, from the fed pre-hash.
+    function initialize (time) {
+        try {
+            time = lap('prehash', time);
+
+            const initialized = instance.exports.argon2_prehash_finish();
+            lap('initialize', time);
+            if (!initialized) {
+                finish(false);
+                return;
+            }
+
+            // The tag is written to the start of the blocks.
+            current.B = instance.exports.argon2_buffer(0);
+        } catch (ex) {
+            console.warn('Could not hash', ex);
+            finish(false);
+            return;
+        }
+        step();
+    }
+
+    function step () {
+        if (current.aborted) {
+            finish(false);
+            return;
+        }
+
+        const { callid, timings } = current;
+        let progress;
+        try {
+            const { argon2_step, argon2_step_pass } = instance.exports;
+            const pass = timings ? argon2_step_pass() : 0;
+            const start = performance.now();
+            progress = argon2_step(step_blocks);
+            if (timings) {
+                timings.passes[pass] = (timings.passes[pass] ?? 0) + performance.now() - start;
+            }
+        } catch (ex) {
+            console.warn('Could not hash', ex);
+            finish(false);
+            return;
+        }
+
+        if (progress >= 1) {
+            const { B, tag_length } = current;
+            const tag = new Uint8Array(instance.memory.buffer).slice(B, B + tag_length);
+            finish(true, tag);
+        } else if (progress < 0) {
+            finish(false);
+        } else {
+            self.postMessage({ progress, callid });
+            yield_channel.port2.postMessage(null);
+        }
+    }
+
+    function finish (success, data) {
+        const { callid, aborted, timings } = current;
+        current = null;
+
+        const start = performance.now();
+        try {
+            // The request is wiped, too, if the parameters were rejected.
+            instance.exports.argon2_wipe();
+        } catch (ex) {
+            console.warn('Could not wipe memory', ex);
+        }
+        if (timings) {
+            timings.wipe = performance.now() - start;
+        }
+
+        self.postMessage({ success, aborted, data, callid, timings });
+
+        idle_timer = setTimeout(release, idle_timeout);
+        pump();
+    }
+
+    start();
 }
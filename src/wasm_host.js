@@ -0,0 +1,85 @@
+// The parts of passwordhash.js that check.js and benchmark.js need in Node.js: instantiating the threaded module on
+// a shared memory, starting its helper threads, and writing a request into a module.
+
+const { Worker, isMainThread, parentPort, workerData } = require('worker_threads');
+
+const {
+    WebAssembly, Uint8Array, Uint32Array, DataView, Promise,
+} = new Function('return this')();
+
+const version = 0x13;
+const hash_types = { d: 0, i: 1, id: 2 };
+
+
+// Started by start_thread().
+if (!isMainThread && workerData?.helper) {
+    run_thread(workerData);
+}
+
+
+// The memory is not exported, so it is added to the exports like the other modules have it.
+function instantiate_shared (module, [initial, maximum]) {
+    const memory = new WebAssembly.Memory({ initial: initial / 65536, maximum: maximum / 65536, shared: true });
+    const { exports } = new WebAssembly.Instance(module, { env: { memory } });
+    return { exports: { ...exports, memory }, memory };
+}
+
+
+// Starts helper thread `index` on the memory of a threaded module. Resolves with the thread once it runs.
+function start_thread (module, memory, index) {
+    const thread = new Worker(__filename, { workerData: { helper: true, module, memory, index } });
+    return new Promise((resolve, reject) => {
+        thread.once('message', () => resolve(thread));
+        thread.once('error', reject);
+    });
+}
+
+
+// A helper thread of the threaded module, like the ones passwordhash.js starts.
+function run_thread ({ module, memory, index }) {
+    const {
+        exports: { __stack_pointer, thread_stacks, thread_stack_layout, argon2_thread },
+    } = new WebAssembly.Instance(module, { env: { memory } });
+    const [stack_size] = new Uint32Array(memory.buffer, thread_stack_layout.value, 2);
+
+    __stack_pointer.value = thread_stacks.value + (index + 1) * stack_size;
+    parentPort.postMessage('started');
+    argon2_thread();  // does not return
+}
+
+
+// Writes a request like passwordhash.js does, returns its address and length. The length is 0 if the module is out
+// of memory.
+function request (exports, { parallelism, tag_length, memory_size_kb, iterations, type, password, salt, key, ad }) {
+    const { argon2_buffer, memory } = exports;
+
+    const strs = [password, salt, key, ad];
+    const length = strs.reduce((length, arr) => length + 4 + arr.length, 4 * 6);
+
+    const B = argon2_buffer(length);
+    if (!B) {
+        return { B, length: 0 };
+    }
+
+    let end = B;
+    const u8view = new Uint8Array(memory.buffer);
+    const dataview = new DataView(memory.buffer);
+
+    for (const value of [parallelism, tag_length, memory_size_kb, iterations, version, hash_types[type]]) {
+        dataview.setUint32(end, value, true);
+        end += 4;
+    }
+
+    for (const arr of strs) {
+        dataview.setUint32(end, arr.length, true);
+        end += 4;
+
+        u8view.set(arr, end);
+        end += arr.length;
+    }
+
+    return { B, length: end - B };
+}
+
+
+module.exports = { hash_types, instantiate_shared, start_thread, request };